@@ -11,9 +11,15 @@ extern "C" void nf7_init(nf7_init_t* init) noexcept {
     nf7->init.register_node(init, &name);  \
   } while (0)
 
+  REGISTER_(archive_read);
+  REGISTER_(codec_hash);
   REGISTER_(stb_image);
+  REGISTER_(text_encode);
+  REGISTER_(text_decode);
   REGISTER_(zlib_inflate);
   REGISTER_(zlib_deflate);
+  REGISTER_(zlib_nfile_read);
+  REGISTER_(codec_trace);
 
 # undef REGISTER_
 }
@@ -0,0 +1,779 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <zlib-ng.h>
+
+#include "nf7.hh"
+
+#include "common/memory.hh"
+#include "common/node.hh"
+#include "common/queue.hh"
+#include "common/trace.hh"
+#include "common/value.hh"
+
+#include "codec/zlib.hh"
+
+using namespace std::literals;
+
+
+static void* init() noexcept;
+static void deinit(void*) noexcept;
+static void handle(const nf7_node_msg_t*) noexcept;
+
+using I = pp::Sockets<"open", "get", "close", "abort", "stat">;
+using O = pp::Sockets<"index", "member", "stat", "error">;
+extern "C" const nf7_node_t archive_read = {
+  .name    = "archive_read",
+  .desc    = "extracts members from a zip, tar or tar.gz native file through an index",
+  .inputs  = I::kList,
+  .outputs = O::kList,
+  .init    = init,
+  .deinit  = deinit,
+  .handle  = handle,
+};
+
+
+static uint64_t LE(const uint8_t* p, size_t n) noexcept {
+  uint64_t ret = 0;
+  for (size_t i = 0; i < n; ++i) {
+    ret |= uint64_t {p[i]} << (i*8);
+  }
+  return ret;
+}
+
+static void ReadAt(std::ifstream& st, uint64_t off, std::span<uint8_t> buf) {
+  st.clear();
+  st.seekg(static_cast<std::streamoff>(off), std::ios_base::beg);
+  st.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(buf.size()));
+  if (!st) throw std::runtime_error {"failed to read"};
+}
+
+
+namespace {
+
+struct Member final {
+  enum Method { kStore, kDeflate, };
+
+  // zip: offset of the local header in the file
+  // tar: offset of the data in the (uncompressed) tar stream
+  uint64_t offset;
+  uint64_t csize;
+  uint64_t usize;
+  uint32_t crc    = 0;
+  Method   method = kStore;
+};
+
+// a point where inflation of a gzip stream can be restarted
+struct AccessPoint final {
+  uint64_t in;    // offset of the first full byte in the file
+  uint64_t out;   // offset in the decompressed stream
+  int      bits;  // bits of the byte before 'in', which belong to the point
+
+  std::vector<uint8_t> window;
+};
+
+struct Index final {
+  enum Format { kZip, kTar, kTarGz, };
+
+  std::filesystem::path npath;
+  Format format;
+
+  // bytes of the file, or of the decompressed stream for kTarGz
+  uint64_t size = 0;
+
+  std::unordered_map<std::string, Member> members;
+  std::vector<std::string> names;
+
+  // for kTarGz, sorted by 'out'
+  std::vector<AccessPoint> points;
+
+  void Add(std::string name, Member m) {
+    if (members.emplace(name, m).second) {
+      names.push_back(std::move(name));
+    }
+  }
+};
+
+
+// parses a tar stream fed by chunks, and collects regular files
+struct TarParser final {
+ public:
+  TarParser(Index& idx) noexcept : idx_(idx) {
+  }
+
+  void Feed(std::span<const uint8_t> buf) {
+    while (buf.size() > 0 && !ended_) {
+      switch (state_) {
+      case kHeader: {
+        const auto n = std::min(buf.size(), 512-hdr_.size());
+        hdr_.insert(hdr_.end(), buf.begin(), buf.begin()+static_cast<ptrdiff_t>(n));
+        Consume(buf, n);
+        if (hdr_.size() == 512) ParseHeader();
+      } break;
+      case kMeta: {
+        const auto n = std::min<uint64_t>(buf.size(), want_-meta_.size());
+        meta_.insert(meta_.end(), buf.begin(), buf.begin()+static_cast<ptrdiff_t>(n));
+        Consume(buf, n);
+        if (meta_.size() == want_) ParseMeta();
+      } break;
+      case kSkip: {
+        const auto n = std::min<uint64_t>(buf.size(), skip_);
+        skip_ -= n;
+        Consume(buf, n);
+        if (skip_ == 0) state_ = kHeader;
+      } break;
+      }
+    }
+  }
+
+  // skips the data of the current entry without feeding,
+  // and returns the next offset to be fed
+  uint64_t SkipData() noexcept {
+    if (state_ == kSkip) {
+      pos_  += skip_;
+      skip_  = 0;
+      state_ = kHeader;
+    }
+    return pos_;
+  }
+
+  bool ended() const noexcept { return ended_; }
+
+ private:
+  Index& idx_;
+
+  static constexpr uint64_t kMaxMeta = 1024*1024;
+
+  enum { kHeader, kMeta, kSkip, } state_ = kHeader;
+  uint64_t pos_  = 0;
+  uint64_t skip_ = 0;
+  uint64_t want_ = 0;
+  bool     ended_ = false;
+
+  std::vector<uint8_t> hdr_;
+  std::vector<uint8_t> meta_;
+  char metatype_ = 0;
+
+  // a name given by the preceding GNU long name or pax header
+  std::string name_;
+
+
+  void Consume(std::span<const uint8_t>& buf, uint64_t n) noexcept {
+    buf  = buf.subspan(static_cast<size_t>(n));
+    pos_ += n;
+  }
+  static uint64_t Pad(uint64_t n) noexcept {
+    return (n+511)/512*512;
+  }
+
+  void ParseHeader() {
+    const auto h = hdr_.data();
+    if (std::all_of(hdr_.begin(), hdr_.end(), [](auto c) { return c == 0; })) {
+      ended_ = true;
+      return;
+    }
+
+    uint64_t size = 0;
+    if (h[124] & 0x80) {
+      for (size_t i = 125; i < 136; ++i) size = (size << 8) | h[i];
+    } else {
+      for (size_t i = 124; i < 136 && h[i]; ++i) {
+        if (h[i] < '0' || '7' < h[i]) continue;
+        size = size*8 + static_cast<uint64_t>(h[i]-'0');
+      }
+    }
+
+    // metadata too large for a name is skipped like an unknown entry,
+    // so that a header cannot make the parser buffer an arbitrary size
+    const auto type = static_cast<char>(h[156]);
+    hdr_.clear();
+    if ((type == 'L' || type == 'x') && size <= kMaxMeta) {
+      metatype_ = type;
+      want_     = size;
+      skip_     = Pad(size)-size;
+      meta_.clear();
+      state_ = want_ > 0? kMeta: kSkip;
+      return;
+    }
+    if (type == '0' || type == '\0' || type == '7') {
+      std::string name;
+      if (name_.size()) {
+        name = std::move(name_);
+      } else {
+        const auto str = [&](size_t off, size_t n) {
+          const auto p = reinterpret_cast<const char*>(h+off);
+          return std::string {p, strnlen(p, n)};
+        };
+        // only POSIX ustar has the prefix, old GNU tar keeps times there
+        if (std::memcmp(h+257, "ustar\0" "00", 8) == 0 && h[345]) {
+          name = str(345, 155) + "/";
+        }
+        name += str(0, 100);
+      }
+      idx_.Add(std::move(name), Member {.offset = pos_, .csize = size, .usize = size});
+    }
+    name_.clear();
+    skip_  = Pad(size);
+    state_ = kSkip;
+  }
+  void ParseMeta() {
+    if (metatype_ == 'L') {
+      name_ = std::string {reinterpret_cast<const char*>(meta_.data()), meta_.size()};
+      name_.resize(strnlen(name_.c_str(), name_.size()));
+    } else {
+      // pax records: "<len> <key>=<value>\n"
+      const std::string_view recs {reinterpret_cast<const char*>(meta_.data()), meta_.size()};
+      for (size_t i = 0; i < recs.size();) {
+        const auto sp  = recs.find(' ', i);
+        if (sp == std::string_view::npos) break;
+        const auto len = std::strtoull(std::string {recs.substr(i, sp-i)}.c_str(), nullptr, 10);
+        if (len == 0 || i+len > recs.size()) break;
+
+        const auto rec = recs.substr(sp+1, i+len-sp-2);
+        if (rec.starts_with("path=")) {
+          name_ = rec.substr(5);
+        }
+        i += len;
+      }
+    }
+    state_ = skip_ > 0? kSkip: kHeader;
+  }
+};
+
+
+static void BuildZipIndex(std::ifstream& st, Index& idx) {
+  st.seekg(0, std::ios_base::end);
+  const auto fsize = static_cast<uint64_t>(st.tellg());
+  idx.size = fsize;
+
+  // finds the end of central directory record
+  std::vector<uint8_t> tail(static_cast<size_t>(std::min<uint64_t>(fsize, 22+65535)));
+  const auto tailoff = fsize-tail.size();
+  ReadAt(st, tailoff, tail);
+
+  size_t eocd = tail.size();
+  for (size_t i = tail.size() >= 22? tail.size()-22+1: 0; i-- > 0;) {
+    if (LE(&tail[i], 4) == 0x06054b50) {
+      eocd = i;
+      break;
+    }
+  }
+  if (eocd == tail.size()) throw std::runtime_error {"zip: no end of central directory"};
+
+  uint64_t count = LE(&tail[eocd+10], 2);
+  uint64_t cdsz  = LE(&tail[eocd+12], 4);
+  uint64_t cdoff = LE(&tail[eocd+16], 4);
+  if (count == 0xFFFF || cdsz == 0xFFFFFFFF || cdoff == 0xFFFFFFFF) {
+    if (eocd < 20 || LE(&tail[eocd-20], 4) != 0x07064b50) {
+      throw std::runtime_error {"zip: missing zip64 locator"};
+    }
+    uint8_t rec[56];
+    ReadAt(st, LE(&tail[eocd-20+8], 8), rec);
+    if (LE(rec, 4) != 0x06064b50) throw std::runtime_error {"zip: broken zip64 record"};
+    count = LE(rec+32, 8);
+    cdsz  = LE(rec+40, 8);
+    cdoff = LE(rec+48, 8);
+  }
+  if (cdoff+cdsz > fsize) throw std::runtime_error {"zip: broken central directory"};
+
+  std::vector<uint8_t> cd(static_cast<size_t>(cdsz));
+  ReadAt(st, cdoff, cd);
+
+  size_t i = 0;
+  for (uint64_t n = 0; n < count; ++n) {
+    if (i+46 > cd.size() || LE(&cd[i], 4) != 0x02014b50) {
+      throw std::runtime_error {"zip: broken central directory entry"};
+    }
+    const auto p      = &cd[i];
+    const auto method = LE(p+10, 2);
+    const auto nlen   = static_cast<size_t>(LE(p+28, 2));
+    const auto elen   = static_cast<size_t>(LE(p+30, 2));
+    const auto clen   = static_cast<size_t>(LE(p+32, 2));
+    if (i+46+nlen+elen+clen > cd.size()) {
+      throw std::runtime_error {"zip: broken central directory entry"};
+    }
+
+    Member m {
+      .offset = LE(p+42, 4),
+      .csize  = LE(p+20, 4),
+      .usize  = LE(p+24, 4),
+      .crc    = static_cast<uint32_t>(LE(p+16, 4)),
+    };
+
+    // zip64 extended information
+    for (size_t j = 0; j+4 <= elen;) {
+      const auto e     = p+46+nlen+j;
+      const auto id    = LE(e, 2);
+      const auto esize = static_cast<size_t>(LE(e+2, 2));
+      if (j+4+esize > elen) break;
+      if (id == 0x0001) {
+        size_t k = 4;
+        const auto take = [&](uint64_t& v) {
+          if (v == 0xFFFFFFFF && k+8 <= 4+esize) {
+            v  = LE(e+k, 8);
+            k += 8;
+          }
+        };
+        take(m.usize);
+        take(m.csize);
+        take(m.offset);
+      }
+      j += 4+esize;
+    }
+
+    std::string name {reinterpret_cast<const char*>(p+46), nlen};
+    i += 46+nlen+elen+clen;
+
+    if (name.ends_with('/')) continue;
+    if (LE(p+8, 2) & 1) continue;  // encrypted
+    switch (method) {
+    case 0: m.method = Member::kStore;   break;
+    case 8: m.method = Member::kDeflate; break;
+    default: continue;
+    }
+    idx.Add(std::move(name), m);
+  }
+}
+
+static void BuildTarIndex(std::ifstream& st, Index& idx,
+                          const pp::AbortSignal::Token& abort) {
+  TarParser parser {idx};
+
+  st.clear();
+  st.seekg(0, std::ios_base::end);
+  idx.size = static_cast<uint64_t>(st.tellg());
+
+  uint8_t hdr[512];
+  for (uint64_t off = 0; !parser.ended();) {
+    abort.ThrowIfAborted();
+    st.clear();
+    st.seekg(static_cast<std::streamoff>(off), std::ios_base::beg);
+    st.read(reinterpret_cast<char*>(hdr), sizeof(hdr));
+    if (st.gcount() == 0) break;
+
+    parser.Feed({hdr, static_cast<size_t>(st.gcount())});
+    off = parser.SkipData();
+  }
+}
+
+static void BuildTarGzIndex(std::ifstream& st, Index& idx, pp::Pool& pool,
+                            const pp::AbortSignal::Token& abort) {
+  // an access point is made for each span of the decompressed stream
+  static constexpr uint64_t kSpan   = 1024*1024;
+  static constexpr size_t   kWindow = 32*1024;
+
+  TarParser parser {idx};
+  pp::zlib::Stream s {pool, pp::zlib::Stream::kInflate, 0, MAX_WBITS+16};
+  auto& zs = s.st;
+
+  std::vector<uint8_t> in(128*1024);
+  std::vector<uint8_t> window(kWindow);
+
+  st.clear();
+  st.seekg(0, std::ios_base::beg);
+
+  uint64_t totin = 0, totout = 0, last = 0;
+  int ret = Z_OK;
+  zs.avail_out = 0;
+  for (;;) {
+    if (zs.avail_in == 0) {
+      abort.ThrowIfAborted();
+      st.read(reinterpret_cast<char*>(in.data()), static_cast<std::streamsize>(in.size()));
+      if (st.bad()) throw std::runtime_error {"failed to read"};
+      if (st.gcount() == 0) {
+        if (ret == Z_STREAM_END) break;
+        throw std::runtime_error {"gzip: unexpected end of file"};
+      }
+      s.SetInput({in.data(), static_cast<size_t>(st.gcount())});
+    }
+    if (ret == Z_STREAM_END) {
+      // goes on to the next member of a concatenated gzip,
+      // or ignores trailing garbage as gzip does
+      if (zs.next_in[0] != 0x1f) break;
+      zng_inflateReset(&zs);
+    }
+
+    PP_TRACE_SPAN("archive_read:index");
+    if (zs.avail_out == 0) {
+      zs.next_out  = window.data();
+      zs.avail_out = static_cast<uint32_t>(window.size());
+    }
+    const auto outbegin = zs.next_out;
+
+    totin  += zs.avail_in;
+    totout += zs.avail_out;
+    ret = zng_inflate(&zs, Z_BLOCK);
+    totin  -= zs.avail_in;
+    totout -= zs.avail_out;
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      throw std::runtime_error {zs.msg? zs.msg: "zlib error"};
+    }
+    if (!parser.ended()) {
+      parser.Feed({outbegin, static_cast<size_t>(zs.next_out-outbegin)});
+    }
+
+    const bool boundary = (zs.data_type & 128) && !(zs.data_type & 64);
+    if (ret != Z_STREAM_END && boundary && (totout == 0 || totout-last >= kSpan)) {
+      // the window is circular, the oldest byte is at next_out
+      AccessPoint pt {
+        .in     = totin,
+        .out    = totout,
+        .bits   = zs.data_type & 7,
+        .window = {},
+      };
+      const auto have = static_cast<size_t>(std::min<uint64_t>(totout, kWindow));
+      const auto head = static_cast<size_t>(zs.next_out-window.data());
+      pt.window.resize(have);
+      if (have == kWindow) {
+        std::copy(window.begin()+static_cast<ptrdiff_t>(head), window.end(), pt.window.begin());
+        std::copy(window.begin(), window.begin()+static_cast<ptrdiff_t>(head),
+                  pt.window.begin()+static_cast<ptrdiff_t>(kWindow-head));
+      } else {
+        std::copy(window.begin()+static_cast<ptrdiff_t>(head-have),
+                  window.begin()+static_cast<ptrdiff_t>(head), pt.window.begin());
+      }
+      idx.points.push_back(std::move(pt));
+      last = totout;
+    }
+  }
+  idx.size = totout;
+}
+
+
+// extracts a member on a worker thread, and can run concurrently with others
+struct Session final {
+ public:
+  std::shared_ptr<const Index> idx;
+  std::shared_ptr<pp::Pool>    pool;
+
+  std::string name;
+  Member      m;
+
+  pp::AbortSignal::Token abort;
+
+  void operator()(nf7_ctx_t* ctx) noexcept
+  try {
+    PP_TRACE_SPAN("archive_read:extract");
+    abort.ThrowIfAborted();
+    std::ifstream st {idx->npath, std::ios::binary};
+    if (!st) throw std::runtime_error {"failed to open"};
+
+    static const char* names[] = {"name", "buf", nullptr};
+    nf7_value_t* values[2];
+    pp::MutValue {ctx->value}.AllocateTuple(names, values);
+    pp::MutValue {values[0]} = std::string_view {name};
+
+    const auto dst = std::span<uint8_t> {
+      pp::MutValue {values[1]}.AllocateVector(static_cast<size_t>(m.usize)),
+      static_cast<size_t>(m.usize),
+    };
+    switch (idx->format) {
+    case Index::kZip:   ExtractZip(st, dst);   break;
+    case Index::kTar:   ReadStored(st, m.offset, dst); break;
+    case Index::kTarGz: ExtractTarGz(st, dst); break;
+    }
+
+    PP_TRACE_SPAN("archive_read:emit");
+    pp::Emit<"member", O>(ctx, ctx->value);
+  } catch (pp::Aborted&) {
+  } catch (std::exception& e) {
+    pp::MutValue {ctx->value} = name + ": " + e.what();
+    pp::Emit<"error", O>(ctx, ctx->value);
+  }
+
+ private:
+  void ExtractZip(std::ifstream& st, std::span<uint8_t> dst) {
+    uint8_t hdr[30];
+    ReadAt(st, m.offset, hdr);
+    if (LE(hdr, 4) != 0x04034b50) throw std::runtime_error {"zip: broken local header"};
+    const auto data = m.offset + 30 + LE(hdr+26, 2) + LE(hdr+28, 2);
+
+    if (m.method == Member::kStore) {
+      ReadStored(st, data, dst);
+    } else {
+      st.clear();
+      st.seekg(static_cast<std::streamoff>(data), std::ios_base::beg);
+      pp::zlib::Stream s {*pool, pp::zlib::Stream::kInflate, 0, -MAX_WBITS};
+      Inflate(st, s, m.csize, 0, dst, abort, false);
+    }
+    if (zng_crc32(0, dst.data(), static_cast<uint32_t>(dst.size())) != m.crc) {
+      throw std::runtime_error {"zip: crc mismatch"};
+    }
+  }
+  void ExtractTarGz(std::ifstream& st, std::span<uint8_t> dst) {
+    auto itr = std::upper_bound(
+        idx->points.begin(), idx->points.end(), m.offset,
+        [](auto off, auto& pt) { return off < pt.out; });
+    if (itr == idx->points.begin()) throw std::runtime_error {"gzip: no access point"};
+    const auto& pt = *--itr;
+
+    pp::zlib::Stream s {*pool, pp::zlib::Stream::kInflate, 0, -MAX_WBITS};
+    st.clear();
+    st.seekg(static_cast<std::streamoff>(pt.in - (pt.bits? 1: 0)), std::ios_base::beg);
+    if (pt.bits) {
+      const int c = st.get();
+      if (c == EOF) throw std::runtime_error {"failed to read"};
+      zng_inflatePrime(&s.st, pt.bits, c >> (8-pt.bits));
+    }
+    if (pt.window.size()) {
+      zng_inflateSetDictionary(
+          &s.st, pt.window.data(), static_cast<uint32_t>(pt.window.size()));
+    }
+    Inflate(st, s, UINT64_MAX, m.offset-pt.out, dst, abort, true);
+  }
+
+  // reads a member stored without compression in pieces,
+  // so that an abort is noticed during a large read
+  void ReadStored(std::ifstream& st, uint64_t off, std::span<uint8_t> dst) {
+    static constexpr size_t kPiece = 1024*1024;
+    while (dst.size() > 0) {
+      abort.ThrowIfAborted();
+      const auto n = std::min(dst.size(), kPiece);
+      ReadAt(st, off, dst.first(n));
+      off += n;
+      dst  = dst.subspan(n);
+    }
+  }
+
+  // inflates at most 'avail' bytes of the file from the current position,
+  // discards first 'skip' bytes of the output and fills dst by the rest.
+  // If gzip is true, the raw stream is a part of a gzip member,
+  // and the inflation goes on to the following members.
+  static void Inflate(std::ifstream& st, pp::zlib::Stream& s,
+                      uint64_t avail, uint64_t skip, std::span<uint8_t> dst,
+                      const pp::AbortSignal::Token& abort, bool gzip) {
+    auto& zs = s.st;
+
+    uint8_t in[64*1024];
+    uint8_t discard[32*1024];
+    bool   raw     = true;
+    size_t trailer = 0;
+    while (dst.size() > 0) {
+      if (zs.avail_in == 0) {
+        abort.ThrowIfAborted();
+        const auto n = std::min<uint64_t>(avail, sizeof(in));
+        st.read(reinterpret_cast<char*>(in), static_cast<std::streamsize>(n));
+        if (st.gcount() == 0) throw std::runtime_error {"unexpected end of file"};
+        avail -= static_cast<uint64_t>(st.gcount());
+        s.SetInput({in, static_cast<size_t>(st.gcount())});
+      }
+      if (trailer > 0) {
+        const auto n = std::min<size_t>(trailer, zs.avail_in);
+        zs.next_in  += n;
+        zs.avail_in -= static_cast<uint32_t>(n);
+        trailer     -= n;
+        continue;
+      }
+
+      const auto out = skip > 0?
+          std::span<uint8_t> {discard, static_cast<size_t>(std::min<uint64_t>(skip, sizeof(discard)))}:
+          dst.first(std::min<size_t>(dst.size(), UINT32_MAX));
+      zs.next_out  = out.data();
+      zs.avail_out = static_cast<uint32_t>(out.size());
+
+      const int ret = zng_inflate(&zs, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        throw std::runtime_error {zs.msg? zs.msg: "zlib error"};
+      }
+
+      const auto n = out.size() - zs.avail_out;
+      if (skip > 0) {
+        skip -= n;
+      } else {
+        dst = dst.subspan(n);
+      }
+      if (ret == Z_STREAM_END && (skip > 0 || dst.size() > 0)) {
+        if (!gzip) throw std::runtime_error {"unexpected end of stream"};
+
+        // the raw stream leaves the trailer of its member (CRC32 and ISIZE),
+        // which the following members in gzip format consume by themselves
+        if (std::exchange(raw, false)) {
+          trailer = 8;
+          zng_inflateReset2(&zs, MAX_WBITS+16);
+        } else {
+          zng_inflateReset(&zs);
+        }
+      }
+    }
+  }
+};
+
+
+struct Context final {
+ public:
+  // members larger than this are refused without allocating their buffers
+  static constexpr uint64_t kDefaultMax = uint64_t {1} << 30;
+
+  struct Open final {
+    std::filesystem::path npath;
+    uint64_t max = kDefaultMax;
+  };
+  struct Get final {
+    std::string name;
+  };
+  struct Close final { };
+  using V = std::variant<Open, Get, Close>;
+
+  void operator()(nf7_ctx_t* ctx, const V& v) noexcept
+  try {
+    PP_TRACE_SPAN("archive_read:handle");
+    std::visit([&](auto& v) { Handle(ctx, v); }, v);
+  } catch (pp::Aborted&) {
+  } catch (std::exception& e) {
+    pp::MutValue {ctx->value} = e.what();
+    pp::Emit<"error", O>(ctx, ctx->value);
+  }
+  void Push(nf7_ctx_t* ctx, V&& v) noexcept {
+    q_.PushAndVisit<Context>(ctx, std::move(v));
+  }
+  // drops pending requests, and stops indexing and extractions in progress
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, Close {});
+  }
+  void EmitStat(nf7_ctx_t* ctx, nf7_value_t* v) noexcept {
+    pp::EmitMemoryStat<O>(ctx, v, *pool_);
+  }
+
+  void Handle(nf7_ctx_t* ctx, const Open& p) {
+    idx_ = nullptr;
+    max_ = p.max;
+
+    std::ifstream st {p.npath, std::ios::binary};
+    if (!st) throw std::runtime_error {"failed to open"};
+
+    auto idx = std::make_shared<Index>();
+    idx->npath = std::filesystem::absolute(p.npath);
+
+    uint8_t magic[4] = {0};
+    st.read(reinterpret_cast<char*>(magic), sizeof(magic));
+    if (magic[0] == 'P' && magic[1] == 'K') {
+      idx->format = Index::kZip;
+      BuildZipIndex(st, *idx);
+    } else if (magic[0] == 0x1f && magic[1] == 0x8b) {
+      idx->format = Index::kTarGz;
+      BuildTarGzIndex(st, *idx, *pool_, q_.token());
+    } else {
+      idx->format = Index::kTar;
+      BuildTarIndex(st, *idx, q_.token());
+    }
+    idx_ = std::move(idx);
+
+    std::string names;
+    for (const auto& name : idx_->names) {
+      names += name;
+      names += '\n';
+    }
+    pp::MutValue {ctx->value} = std::string_view {names};
+    pp::Emit<"index", O>(ctx, ctx->value);
+  }
+  void Handle(nf7_ctx_t* ctx, const Get& p) {
+    if (!idx_) throw std::runtime_error {"not opened"};
+
+    auto itr = idx_->members.find(p.name);
+    if (itr == idx_->members.end()) {
+      throw std::runtime_error {"no such member: "s + p.name};
+    }
+    Validate(p.name, itr->second);
+
+    auto ss = new Session {
+      .idx   = idx_,
+      .pool  = pool_,
+      .name  = p.name,
+      .m     = itr->second,
+      .abort = q_.token(),
+    };
+    nf7->ctx.exec_async(ctx, ss, [](auto ctx, auto ptr) {
+      auto ss = reinterpret_cast<Session*>(ptr);
+      (*ss)(ctx);
+      delete ss;
+    }, 0);
+  }
+  void Handle(nf7_ctx_t*, const Close&) {
+    idx_ = nullptr;
+  }
+
+ private:
+  pp::Queue<V> q_ {"archive_read:wait"};
+  uint64_t max_ = kDefaultMax;
+
+  // shared with sessions in progress
+  std::shared_ptr<pp::Pool> pool_ = std::make_shared<pp::Pool>();
+  std::shared_ptr<const Index> idx_;
+
+
+  // refuses sizes declared by a broken or crafted archive before allocation
+  void Validate(const std::string& name, const Member& m) const {
+    if (m.usize > max_) {
+      throw std::runtime_error {name + ": too large member (" +
+                                std::to_string(m.usize) + " bytes)"};
+    }
+    bool ok = true;
+    switch (idx_->format) {
+    case Index::kZip:
+      // deflate cannot expand data more than 1032 times
+      ok = m.offset < idx_->size && m.csize <= idx_->size &&
+          (m.method == Member::kStore? m.usize == m.csize: m.usize/1032 <= m.csize);
+      break;
+    case Index::kTar:
+    case Index::kTarGz:
+      ok = m.offset <= idx_->size && m.usize <= idx_->size-m.offset;
+      break;
+    }
+    if (!ok) throw std::runtime_error {name + ": broken member size"};
+  }
+};
+
+}  // namespace
+
+
+static void* init() noexcept {
+  return new Context;
+}
+static void deinit(void* ptr) noexcept {
+  delete reinterpret_cast<Context*>(ptr);
+}
+
+static void handle(const nf7_node_msg_t* in) noexcept
+try {
+  PP_TRACE_SPAN("archive_read:recv");
+  auto  v   = pp::ConstValue {in->value};
+  auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
+  I::Dispatch(in->name, [&](pp::In<"open">) {
+    switch (v.type()) {
+    case NF7_STRING:
+      ctx.Push(in->ctx, Context::Open {.npath = v.string()});
+      break;
+    case NF7_TUPLE: {
+      const auto max = v.find("max");
+      ctx.Push(in->ctx, Context::Open {
+        .npath = v["npath"].string(),
+        .max   = max? max->integerOrScalar<uint64_t>(): Context::kDefaultMax,
+      });
+    } break;
+    default:
+      throw std::runtime_error {"invalid input"};
+    }
+  }, [&](pp::In<"get">) {
+    ctx.Push(in->ctx, Context::Get {.name = std::string {v.string()}});
+  }, [&](pp::In<"close">) {
+    ctx.Push(in->ctx, Context::Close {});
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  }, [&](pp::In<"stat">) {
+    ctx.EmitStat(in->ctx, in->value);
+  });
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  pp::Emit<"error", O>(in->ctx, in->value);
+}
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+
+#include <zlib-ng.h>
+
+#include "nf7.hh"
+
+#include "common/node.hh"
+#include "common/queue.hh"
+#include "common/trace.hh"
+#include "common/value.hh"
+
+
+static void* init() noexcept;
+static void deinit(void*) noexcept;
+static void handle(const nf7_node_msg_t*) noexcept;
+
+using I = pp::Sockets<"start", "in", "end", "abort">;
+using O = pp::Sockets<"out", "error">;
+extern "C" const nf7_node_t codec_hash = {
+  .name    = "codec_hash",
+  .desc    = "calculates a checksum (crc32, adler32) or a hash (xxh64) of a byte stream",
+  .inputs  = I::kList,
+  .outputs = O::kList,
+  .init    = init,
+  .deinit  = deinit,
+  .handle  = handle,
+};
+
+
+namespace {
+
+// streaming XXH64 with seed 0
+struct XXH64 final {
+ public:
+  static constexpr uint64_t kP1 = 0x9E3779B185EBCA87;
+  static constexpr uint64_t kP2 = 0xC2B2AE3D27D4EB4F;
+  static constexpr uint64_t kP3 = 0x165667B19E3779F9;
+  static constexpr uint64_t kP4 = 0x85EBCA77C2B2AE63;
+  static constexpr uint64_t kP5 = 0x27D4EB2F165667C5;
+
+  static constexpr size_t kSize = 8;
+
+  void Update(std::span<const uint8_t> in) noexcept {
+    if (in.empty()) return;
+    total_ += in.size();
+    if (bufn_ > 0) {
+      const auto n = std::min(in.size(), sizeof(buf_)-bufn_);
+      std::memcpy(buf_+bufn_, in.data(), n);
+      bufn_ += n;
+      in     = in.subspan(n);
+      if (bufn_ < sizeof(buf_)) return;
+      Stripes(buf_, sizeof(buf_));
+      bufn_ = 0;
+    }
+    const auto n = in.size()/32*32;
+    Stripes(in.data(), n);
+    if (n < in.size()) {
+      std::memcpy(buf_, in.data()+n, in.size()-n);
+    }
+    bufn_ = in.size()-n;
+  }
+
+  // returns the digest in big endian
+  void Digest(uint8_t* dst) const noexcept {
+    const auto h = Finalize();
+    for (size_t i = 0; i < 8; ++i) {
+      dst[7-i] = static_cast<uint8_t>(h >> (i*8));
+    }
+  }
+
+ private:
+  uint64_t v_[4] = {kP1 + kP2, kP2, 0, 0 - kP1};
+
+  uint8_t  buf_[32];
+  size_t   bufn_  = 0;
+  uint64_t total_ = 0;
+
+
+  static uint64_t Read64(const uint8_t* p) noexcept {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    if constexpr (std::endian::native == std::endian::big) v = Swap(v);
+    return v;
+  }
+  static uint64_t Read32(const uint8_t* p) noexcept {
+    return uint64_t {p[0]}       | uint64_t {p[1]} <<  8 |
+           uint64_t {p[2]} << 16 | uint64_t {p[3]} << 24;
+  }
+  static uint64_t Swap(uint64_t v) noexcept {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < 8; ++i) ret = (ret << 8) | ((v >> (i*8)) & 0xFF);
+    return ret;
+  }
+
+  static uint64_t Round(uint64_t acc, uint64_t in) noexcept {
+    return std::rotl(acc + in*kP2, 31) * kP1;
+  }
+  static uint64_t Merge(uint64_t acc, uint64_t v) noexcept {
+    return (acc ^ Round(0, v))*kP1 + kP4;
+  }
+
+  void Stripes(const uint8_t* p, size_t n) noexcept {
+    PP_TRACE_SPAN("hash:stripes");
+    for (size_t off = 0; off < n; off += 32) {
+      for (size_t i = 0; i < 4; ++i) {
+        v_[i] = Round(v_[i], Read64(p+off+i*8));
+      }
+    }
+  }
+
+  uint64_t Finalize() const noexcept {
+    const auto& v = v_;
+
+    uint64_t h;
+    if (total_ >= 32) {
+      h = std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) + std::rotl(v[3], 18);
+      for (auto x : v) h = Merge(h, x);
+    } else {
+      h = kP5;
+    }
+    h += total_;
+
+    const uint8_t* p   = buf_;
+    const uint8_t* end = buf_+bufn_;
+    for (; p+8 <= end; p += 8) {
+      h ^= Round(0, Read64(p));
+      h  = std::rotl(h, 27)*kP1 + kP4;
+    }
+    if (p+4 <= end) {
+      h ^= Read32(p)*kP1;
+      h  = std::rotl(h, 23)*kP2 + kP3;
+      p += 4;
+    }
+    for (; p < end; ++p) {
+      h ^= uint64_t {*p}*kP5;
+      h  = std::rotl(h, 11)*kP1;
+    }
+
+    h ^= h >> 33;
+    h *= kP2;
+    h ^= h >> 29;
+    h *= kP3;
+    h ^= h >> 32;
+    return h;
+  }
+};
+
+
+// zlib-ng picks SIMD implementations of these by the CPU at runtime
+struct CRC32 final {
+  static constexpr size_t kSize = 4;
+
+  uint32_t v = 0;
+  void Update(std::span<const uint8_t> in) noexcept {
+    v = static_cast<uint32_t>(zng_crc32(v, in.data(), static_cast<uint32_t>(in.size())));
+  }
+  void Digest(uint8_t* dst) const noexcept { BigEndian32(dst, v); }
+
+  static void BigEndian32(uint8_t* dst, uint32_t v) noexcept {
+    for (size_t i = 0; i < 4; ++i) dst[3-i] = static_cast<uint8_t>(v >> (i*8));
+  }
+};
+struct Adler32 final {
+  static constexpr size_t kSize = 4;
+
+  uint32_t v = 1;
+  void Update(std::span<const uint8_t> in) noexcept {
+    v = static_cast<uint32_t>(zng_adler32(v, in.data(), static_cast<uint32_t>(in.size())));
+  }
+  void Digest(uint8_t* dst) const noexcept { CRC32::BigEndian32(dst, v); }
+};
+
+
+struct Context final {
+ public:
+  using Hasher = std::variant<XXH64, CRC32, Adler32>;
+
+  struct Start final {
+    Hasher h;
+  };
+  struct Exec final {
+    pp::UniqValue v;
+  };
+  struct End final { };
+  struct Reset final { };
+  using V = std::variant<Start, Exec, End, Reset>;
+
+  void operator()(nf7_ctx_t* ctx, const V& v) noexcept
+  try {
+    PP_TRACE_SPAN("hash:handle");
+    std::visit([&](auto& v) { Handle(ctx, v); }, v);
+  } catch (pp::Aborted&) {
+  } catch (std::exception& e) {
+    pp::MutValue {ctx->value} = e.what();
+    pp::Emit<"error", O>(ctx, ctx->value);
+  }
+  void Push(nf7_ctx_t* ctx, V&& v) noexcept {
+    q_.PushAndVisit<Context>(ctx, std::move(v));
+  }
+  // drops pending inputs and the current stream without a digest
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, Reset {});
+  }
+
+  void Handle(nf7_ctx_t*, const Start& p) {
+    h_ = p.h;
+  }
+  void Handle(nf7_ctx_t*, const Exec& p) {
+    // pieces keep lengths in 32 bits for zlib-ng and let an abort be noticed
+    static constexpr size_t kPiece = 4*1024*1024;
+
+    auto buf = p.v.vectorOrString();
+    while (buf.size() > 0) {
+      q_.token().ThrowIfAborted();
+      const auto n = std::min(buf.size(), kPiece);
+      std::visit([&](auto& h) { h.Update(buf.first(n)); }, h_);
+      buf = buf.subspan(n);
+    }
+  }
+  void Handle(nf7_ctx_t* ctx, const End&) {
+    std::visit([&](auto& h) {
+      using H = std::decay_t<decltype(h)>;
+      h.Digest(nf7->value.set_vector(ctx->value, H::kSize));
+
+      // starts the next stream with the same algorithm
+      h = H {};
+    }, h_);
+    pp::Emit<"out", O>(ctx, ctx->value);
+  }
+  void Handle(nf7_ctx_t*, const Reset&) {
+    std::visit([](auto& h) { h = std::decay_t<decltype(h)> {}; }, h_);
+  }
+
+  static Hasher Create(std::string_view name) {
+    if (name == "xxh64")   return XXH64 {};
+    if (name == "crc32")   return CRC32 {};
+    if (name == "adler32") return Adler32 {};
+    throw std::runtime_error {"unknown algorithm (xxh64, crc32 or adler32)"};
+  }
+
+ private:
+  pp::Queue<V> q_ {"hash:wait"};
+
+  Hasher h_;
+};
+
+}  // namespace
+
+
+static void* init() noexcept {
+  return new Context;
+}
+static void deinit(void* ptr) noexcept {
+  delete reinterpret_cast<Context*>(ptr);
+}
+
+static void handle(const nf7_node_msg_t* in) noexcept
+try {
+  PP_TRACE_SPAN("hash:recv");
+  auto  v   = pp::ConstValue {in->value};
+  auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
+  I::Dispatch(in->name, [&](pp::In<"start">) {
+    ctx.Push(in->ctx, Context::Start {.h = Context::Create(v.string())});
+  }, [&](pp::In<"in">) {
+    ctx.Push(in->ctx, Context::Exec {.v = v});
+  }, [&](pp::In<"end">) {
+    ctx.Push(in->ctx, Context::End {});
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  });
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  pp::Emit<"error", O>(in->ctx, in->value);
+}
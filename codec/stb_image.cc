@@ -1,52 +1,110 @@
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <memory>
 
 #include <stb_image.h>
 
 #include "nf7.hh"
 
+#include "common/memory.hh"
+#include "common/node.hh"
+#include "common/queue.hh"
+#include "common/trace.hh"
 #include "common/value.hh"
 
-using namespace std::literals;
-
 
 static void* init() noexcept;
 static void deinit(void*) noexcept;
 static void handle(const nf7_node_msg_t*) noexcept;
 
-static const char* I[] = {"input", nullptr};
-static const char* O[] = {"img", "error", nullptr};
+using I = pp::Sockets<"input", "abort", "stat">;
+using O = pp::Sockets<"img", "stat", "error">;
 extern "C" const nf7_node_t stb_image = {
   .name    = "stb_image",
   .desc    = "decodes an image by stb_image library",
-  .inputs  = I,
-  .outputs = O,
+  .inputs  = I::kList,
+  .outputs = O::kList,
   .init    = init,
   .deinit  = deinit,
   .handle  = handle,
 };
 
 
+namespace {
+
+struct Context final {
+  // decode buffers are reused by the following sessions
+  std::shared_ptr<pp::Pool> pool = std::make_shared<pp::Pool>();
+
+  // aborts all sessions started before
+  pp::AbortSignal abort;
+};
+
 struct Session final {
   // input
   std::string npath;
   int         comp = 0;
 
+  std::shared_ptr<pp::Pool> pool;
+
+  pp::AbortSignal::Token abort;
+  std::FILE*             fp = nullptr;
+
   // output
   bool success = false;
 };
 
+// stb_image reads the file through these, and an aborted session gets EOF
+// at the next read so that the decoder gives up early
+const stbi_io_callbacks kCallbacks = {
+  .read = [](void* ptr, char* buf, int n) {
+    auto& ss = *reinterpret_cast<Session*>(ptr);
+    if (ss.abort.aborted()) return 0;
+    return static_cast<int>(std::fread(buf, 1, static_cast<size_t>(n), ss.fp));
+  },
+  .skip = [](void* ptr, int n) {
+    auto& ss = *reinterpret_cast<Session*>(ptr);
+    std::fseek(ss.fp, n, SEEK_CUR);
+  },
+  .eof = [](void* ptr) {
+    auto& ss = *reinterpret_cast<Session*>(ptr);
+    return ss.abort.aborted() || std::feof(ss.fp)? 1: 0;
+  },
+};
+
+}  // namespace
+
+
+// stb_image allocates through the pool of the session decoding on this thread
+static thread_local pp::Pool* pool_ = nullptr;
+
+extern "C" void* pp_stbi_malloc(size_t n) noexcept {
+  return pp::Pool::Alloc(pool_, n);
+}
+extern "C" void* pp_stbi_realloc(void* ptr, size_t n) noexcept {
+  return pp::Pool::Realloc(pool_, ptr, n);
+}
+extern "C" void pp_stbi_free(void* ptr) noexcept {
+  pp::Pool::Free(ptr);
+}
+
 
 static void* init() noexcept {
-  return nullptr;
+  return new Context;
 }
-static void deinit(void*) noexcept {
+static void deinit(void* ptr) noexcept {
+  delete reinterpret_cast<Context*>(ptr);
 }
 static void handle(const nf7_node_msg_t* in) noexcept
 try {
+  PP_TRACE_SPAN("stb_image:recv");
   pp::ConstValue v = in->value;
-  if (in->name == "input"s) {
+  auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
+  I::Dispatch(in->name, [&](pp::In<"input">) {
     Session ss;
+    ss.pool  = ctx.pool;
+    ss.abort = ctx.abort.token();
 
     switch (v.type()) {
     case NF7_STRING:
@@ -77,7 +135,20 @@ try {
       auto& ss = *reinterpret_cast<Session*>(ptr);
 
       int w, h, comp;
-      if (uint8_t* src = stbi_load(ss.npath.c_str(), &w, &h, &comp, ss.comp)) {
+      uint8_t* src = nullptr;
+      if (!ss.abort.aborted()) {
+        PP_TRACE_SPAN("stb_image:load");
+        ss.fp = std::fopen(ss.npath.c_str(), "rb");
+        if (ss.fp) {
+          pool_ = ss.pool.get();
+          src   = stbi_load_from_callbacks(&kCallbacks, &ss, &w, &h, &comp, ss.comp);
+          pool_ = nullptr;
+          std::fclose(ss.fp);
+        }
+      }
+      if (ss.abort.aborted()) {
+        if (src) stbi_image_free(src);
+      } else if (src) {
         if (ss.comp == 0) {
           ss.comp = comp;
         }
@@ -95,15 +166,20 @@ try {
         std::memcpy(dst, src, size);
         stbi_image_free(src);
 
-        nf7->ctx.exec_emit(ctx, "img", ctx->value, 0);
+        PP_TRACE_SPAN("stb_image:emit");
+        pp::Emit<"img", O>(ctx, ctx->value);
       } else {
         pp::MutValue {ctx->value} = "failed to load image";
-        nf7->ctx.exec_emit(ctx, "error", ctx->value, 0);
+        pp::Emit<"error", O>(ctx, ctx->value);
       }
       delete &ss;
     }, 0);
-  }
+  }, [&](pp::In<"abort">) {
+    ctx.abort.Abort();
+  }, [&](pp::In<"stat">) {
+    pp::EmitMemoryStat<O>(in->ctx, in->value, *ctx.pool);
+  });
 } catch (std::exception& e) {
   pp::MutValue {in->value} = e.what();
-  nf7->ctx.exec_emit(in->ctx, "error", in->value, 0);
+  pp::Emit<"error", O>(in->ctx, in->value);
 }
@@ -0,0 +1,591 @@
+#include <array>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define PP_TEXT_AVX2
+#endif
+
+#include "nf7.hh"
+
+#include "common/node.hh"
+#include "common/queue.hh"
+#include "common/trace.hh"
+#include "common/value.hh"
+
+
+static void* init_encode() noexcept;
+static void* init_decode() noexcept;
+static void deinit(void*) noexcept;
+static void handle(const nf7_node_msg_t*) noexcept;
+
+using I = pp::Sockets<"start", "in", "end", "abort">;
+using O = pp::Sockets<"out", "error">;
+
+extern "C" const nf7_node_t text_encode = {
+  .name    = "text_encode",
+  .desc    = "encodes a byte stream into text (base64, base64url or hex)",
+  .inputs  = I::kList,
+  .outputs = O::kList,
+  .init    = init_encode,
+  .deinit  = deinit,
+  .handle  = handle,
+};
+extern "C" const nf7_node_t text_decode = {
+  .name    = "text_decode",
+  .desc    = "decodes text (base64, base64url or hex) into a byte stream, ignoring whitespaces",
+  .inputs  = I::kList,
+  .outputs = O::kList,
+  .init    = init_decode,
+  .deinit  = deinit,
+  .handle  = handle,
+};
+
+
+namespace {
+
+enum Format { kBase64, kBase64Url, kHex, };
+
+constexpr char kBase64Chars   [] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+constexpr char kBase64UrlChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+constexpr char kHexChars      [] = "0123456789abcdef";
+
+constexpr uint8_t kInvalid = 0xFF;
+
+// both base64 alphabets are accepted by the decoder regardless of the format
+constexpr auto kBase64Values = []() {
+  std::array<uint8_t, 256> ret;
+  ret.fill(kInvalid);
+  for (uint8_t i = 0; i < 64; ++i) {
+    ret[static_cast<uint8_t>(kBase64Chars[i])]    = i;
+    ret[static_cast<uint8_t>(kBase64UrlChars[i])] = i;
+  }
+  return ret;
+}();
+constexpr auto kHexValues = []() {
+  std::array<uint8_t, 256> ret;
+  ret.fill(kInvalid);
+  for (uint8_t i = 0; i < 16; ++i) {
+    ret[static_cast<uint8_t>(kHexChars[i])] = i;
+  }
+  for (uint8_t i = 10; i < 16; ++i) {
+    ret[static_cast<uint8_t>('A'+i-10)] = i;
+  }
+  return ret;
+}();
+
+bool IsSpace(char c) noexcept {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+
+#if defined(PP_TEXT_AVX2)
+// Each kernel processes whole blocks from the head of the input and returns
+// the bytes consumed, leaving the rest to the scalar code.
+// The base64 ones are after the algorithms by Wojciech Muła and Daniel Lemire.
+
+// initialized before constructors of libgcc may run
+const bool kAVX2 = []() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}();
+
+// 24 bytes into 32 chars, reading 28 bytes at once
+__attribute__((target("avx2")))
+size_t EncodeBase64AVX2(const uint8_t* src, size_t n, char* dst, const char* chars) noexcept {
+  // added to each 6-bit value by its range: A-Z, a-z, 0-9 (10 entries), 62, 63
+  const int8_t c62 = static_cast<int8_t>(chars[62]-62);
+  const int8_t c63 = static_cast<int8_t>(chars[63]-63);
+  const __m256i lut = _mm256_setr_epi8(
+      65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, c62, c63, 0, 0,
+      65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, c62, c63, 0, 0);
+  const __m256i shuf = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+
+  size_t i = 0;
+  for (; n-i >= 28; i += 24, dst += 32) {
+    const auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    const auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i+12));
+    auto in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    // splits each 3 bytes into 4 values of 6 bits
+    in = _mm256_shuffle_epi8(in, shuf);
+    const auto t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00));
+    const auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const auto t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0));
+    const auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const auto v  = _mm256_or_si256(t1, t3);
+
+    // translates the values into chars
+    auto idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+    idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+    const auto out = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, idx));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), out);
+  }
+  return i;
+}
+
+// 32 chars into 24 bytes, writing 32 bytes at once,
+// and stops at a block with a char other than the alphabets
+__attribute__((target("avx2")))
+size_t DecodeBase64AVX2(const char* src, size_t n, uint8_t* dst) noexcept {
+  const __m256i lut_lo = _mm256_setr_epi8(
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+  const __m256i shuf    = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i perm    = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+  size_t i = 0;
+  for (; n-i >= 32; i += 32, dst += 24) {
+    auto in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+
+    // the url-safe alphabet is mapped into the standard one
+    in = _mm256_blendv_epi8(in, _mm256_set1_epi8('+'),
+                            _mm256_cmpeq_epi8(in, _mm256_set1_epi8('-')));
+    in = _mm256_blendv_epi8(in, _mm256_set1_epi8('/'),
+                            _mm256_cmpeq_epi8(in, _mm256_set1_epi8('_')));
+
+    const auto hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+    const auto lo_nibbles = _mm256_and_si256(in, mask_2f);
+    const auto hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    const auto lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi)) break;
+
+    const auto eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+    const auto roll  = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    const auto v     = _mm256_add_epi8(in, roll);
+
+    // packs each 4 values of 6 bits into 3 bytes
+    const auto ab  = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    const auto abc = _mm256_madd_epi16(ab, _mm256_set1_epi32(0x00011000));
+    const auto out = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(abc, shuf), perm);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), out);
+  }
+  return i;
+}
+
+// 32 bytes into 64 chars
+__attribute__((target("avx2")))
+size_t EncodeHexAVX2(const uint8_t* src, size_t n, char* dst) noexcept {
+  const __m256i lut = _mm256_setr_epi8(
+      '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+      '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+
+  size_t i = 0;
+  for (; n-i >= 32; i += 32, dst += 64) {
+    const auto in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+    const auto hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+    const auto lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(in, mask));
+
+    // unpacking works in each 128-bit lane
+    const auto a = _mm256_unpacklo_epi8(hi, lo);
+    const auto b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return i;
+}
+
+// 32 chars into 16 bytes,
+// and stops at a block with a char other than hex digits
+__attribute__((target("avx2")))
+size_t DecodeHexAVX2(const char* src, size_t n, uint8_t* dst) noexcept {
+  size_t i = 0;
+  for (; n-i >= 32; i += 32, dst += 16) {
+    const auto in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+
+    const auto d = _mm256_sub_epi8(in, _mm256_set1_epi8('0'));
+    const auto l = _mm256_sub_epi8(_mm256_or_si256(in, _mm256_set1_epi8(0x20)),
+                                   _mm256_set1_epi8('a'));
+    const auto is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    const auto is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+    if (~_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha))) break;
+
+    const auto v = _mm256_blendv_epi8(
+        _mm256_add_epi8(l, _mm256_set1_epi8(10)), d, is_digit);
+
+    // (high nibble)*16 + (low nibble) for each pair
+    const auto pairs  = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0110));
+    const auto packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(packed));
+  }
+  return i;
+}
+#endif
+
+
+// keeps a partial group of bytes between chunks
+struct Encoder final {
+ public:
+  explicit Encoder(Format fmt = kBase64) noexcept : fmt_(fmt) { }
+
+  size_t size(size_t n) const noexcept {
+    return fmt_ == kHex? n*2: (carryn_+n)/3*4;
+  }
+  size_t finalSize() const noexcept {
+    if (carryn_ == 0) return 0;
+    return fmt_ == kBase64? 4: carryn_+1;
+  }
+
+  // writes size(in.size()) chars into dst
+  void Encode(std::span<const uint8_t> in, char* dst) noexcept {
+    if (fmt_ == kHex) {
+      EncodeHex(in, dst);
+      return;
+    }
+    if (carryn_ > 0) {
+      while (carryn_ < 3 && in.size() > 0) {
+        carry_[carryn_++] = in[0];
+        in = in.subspan(1);
+      }
+      if (carryn_ < 3) return;
+      EncodeTriple(carry_, dst);
+      dst    += 4;
+      carryn_ = 0;
+    }
+
+    size_t i = 0;
+#if defined(PP_TEXT_AVX2)
+    if (kAVX2) {
+      i    = EncodeBase64AVX2(in.data(), in.size(), dst, chars());
+      dst += i/3*4;
+    }
+#endif
+    for (; in.size()-i >= 3; i += 3, dst += 4) {
+      EncodeTriple(in.data()+i, dst);
+    }
+    for (; i < in.size(); ++i) {
+      carry_[carryn_++] = in[i];
+    }
+  }
+  // writes finalSize() chars into dst
+  void Finalize(char* dst) noexcept {
+    if (carryn_ == 0) return;
+
+    const auto c = chars();
+    const uint32_t v = uint32_t {carry_[0]} << 16 | (carryn_ > 1? uint32_t {carry_[1]} << 8: 0);
+    dst[0] = c[(v >> 18) & 0x3F];
+    dst[1] = c[(v >> 12) & 0x3F];
+    if (carryn_ > 1) dst[2] = c[(v >> 6) & 0x3F];
+    if (fmt_ == kBase64) {
+      std::memset(dst+carryn_+1, '=', 3-carryn_);
+    }
+    carryn_ = 0;
+  }
+
+ private:
+  Format fmt_;
+
+  uint8_t carry_[3];
+  size_t  carryn_ = 0;
+
+
+  // the url-safe format omits paddings
+  const char* chars() const noexcept {
+    return fmt_ == kBase64Url? kBase64UrlChars: kBase64Chars;
+  }
+
+  void EncodeTriple(const uint8_t* p, char* dst) const noexcept {
+    const auto c = chars();
+    const uint32_t v = uint32_t {p[0]} << 16 | uint32_t {p[1]} << 8 | p[2];
+    dst[0] = c[(v >> 18) & 0x3F];
+    dst[1] = c[(v >> 12) & 0x3F];
+    dst[2] = c[(v >>  6) & 0x3F];
+    dst[3] = c[v & 0x3F];
+  }
+  static void EncodeHex(std::span<const uint8_t> in, char* dst) noexcept {
+    size_t i = 0;
+#if defined(PP_TEXT_AVX2)
+    if (kAVX2) {
+      i    = EncodeHexAVX2(in.data(), in.size(), dst);
+      dst += i*2;
+    }
+#endif
+    for (; i < in.size(); ++i) {
+      *dst++ = kHexChars[in[i] >> 4];
+      *dst++ = kHexChars[in[i] & 0xF];
+    }
+  }
+};
+
+
+// keeps a partial group of chars between chunks
+struct Decoder final {
+ public:
+  // bytes written at once by the vectorized kernels beyond their outputs
+  static constexpr size_t kSlack = 32;
+
+  explicit Decoder(Format fmt = kBase64) noexcept : fmt_(fmt) { }
+
+  // the max bytes Decode() writes into dst
+  size_t capacity(size_t n) const noexcept {
+    return (fmt_ == kHex? (n+1)/2: (n+4)/4*3) + kSlack;
+  }
+
+  // returns the bytes written into dst
+  size_t Decode(std::span<const char> in, uint8_t* dst) {
+    return fmt_ == kHex? DecodeHex(in, dst): DecodeBase64(in, dst);
+  }
+  // returns the bytes written into dst, which must have 2 bytes
+  size_t Finalize(uint8_t* dst) {
+    const auto n = n_;
+    const auto v = v_;
+    n_   = 0;
+    v_   = 0;
+    pad_ = 0;
+    if (fmt_ == kHex) {
+      if (n > 0) throw std::runtime_error {"odd number of hex digits"};
+      return 0;
+    }
+
+    // the paddings are optional
+    switch (n) {
+    case 0:
+      return 0;
+    case 2:
+      dst[0] = static_cast<uint8_t>(v >> 4);
+      return 1;
+    case 3:
+      dst[0] = static_cast<uint8_t>(v >> 10);
+      dst[1] = static_cast<uint8_t>(v >> 2);
+      return 2;
+    default:
+      throw std::runtime_error {"truncated base64"};
+    }
+  }
+
+ private:
+  Format fmt_;
+
+  // pending chars
+  uint32_t v_   = 0;
+  size_t   n_   = 0;
+  size_t   pad_ = 0;
+
+  // the vectorized kernel is not retried until here after failing
+  size_t resume_ = 0;
+
+
+  size_t DecodeBase64(std::span<const char> in, uint8_t* dst) {
+    auto begin = dst;
+    resume_ = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+#if defined(PP_TEXT_AVX2)
+      if (kAVX2 && n_ == 0 && pad_ == 0 && i >= resume_) {
+        const auto k = DecodeBase64AVX2(in.data()+i, in.size()-i, dst);
+        dst += k/4*3;
+        i   += k;
+        if (k == 0) resume_ = i+32;
+        if (i >= in.size()) break;
+      }
+#endif
+      const auto c = in[i];
+      const auto x = kBase64Values[static_cast<uint8_t>(c)];
+      if (x != kInvalid) {
+        if (pad_ > 0) throw std::runtime_error {"base64 data after padding"};
+        v_ = v_ << 6 | x;
+        if (++n_ == 4) {
+          dst[0] = static_cast<uint8_t>(v_ >> 16);
+          dst[1] = static_cast<uint8_t>(v_ >> 8);
+          dst[2] = static_cast<uint8_t>(v_);
+          dst += 3;
+          v_   = 0;
+          n_   = 0;
+        }
+      } else if (c == '=') {
+        ++pad_;
+        if (n_ < 2 || n_+pad_ > 4) throw std::runtime_error {"misplaced base64 padding"};
+        if (n_+pad_ == 4) {
+          // the group ends here, and another one may follow
+          dst += Finalize(dst);
+        }
+      } else if (!IsSpace(c)) {
+        throw std::runtime_error {"invalid base64 char"};
+      }
+    }
+    return static_cast<size_t>(dst-begin);
+  }
+
+  size_t DecodeHex(std::span<const char> in, uint8_t* dst) {
+    auto begin = dst;
+    resume_ = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+#if defined(PP_TEXT_AVX2)
+      if (kAVX2 && n_ == 0 && i >= resume_) {
+        const auto k = DecodeHexAVX2(in.data()+i, in.size()-i, dst);
+        dst += k/2;
+        i   += k;
+        if (k == 0) resume_ = i+32;
+        if (i >= in.size()) break;
+      }
+#endif
+      const auto c = in[i];
+      const auto x = kHexValues[static_cast<uint8_t>(c)];
+      if (x != kInvalid) {
+        v_ = v_ << 4 | x;
+        if (++n_ == 2) {
+          *dst++ = static_cast<uint8_t>(v_);
+          v_ = 0;
+          n_ = 0;
+        }
+      } else if (!IsSpace(c)) {
+        throw std::runtime_error {"invalid hex digit"};
+      }
+    }
+    return static_cast<size_t>(dst-begin);
+  }
+};
+
+
+struct Context final {
+ public:
+  struct Start final {
+    Format fmt;
+  };
+  struct Exec final {
+    pp::UniqValue v;
+  };
+  struct End final { };
+  struct Reset final { };
+  using V = std::variant<Start, Exec, End, Reset>;
+
+  explicit Context(bool encode) noexcept : encode_(encode) { }
+
+  void operator()(nf7_ctx_t* ctx, const V& v) noexcept
+  try {
+    PP_TRACE_SPAN("text:handle");
+    std::visit([&](auto& v) { Handle(ctx, v); }, v);
+  } catch (pp::Aborted&) {
+  } catch (std::exception& e) {
+    // the partial group is dropped to start the next stream cleanly
+    Handle(ctx, Reset {});
+    pp::MutValue {ctx->value} = e.what();
+    pp::Emit<"error", O>(ctx, ctx->value);
+  }
+  void Push(nf7_ctx_t* ctx, V&& v) noexcept {
+    q_.PushAndVisit<Context>(ctx, std::move(v));
+  }
+  // drops pending inputs and the partial group
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, Reset {});
+  }
+
+  void Handle(nf7_ctx_t*, const Start& p) {
+    fmt_ = p.fmt;
+    Handle(nullptr, Reset {});
+  }
+  void Handle(nf7_ctx_t* ctx, const Exec& p) {
+    if (encode_) {
+      const auto in = p.v.vectorOrString();
+      const auto n  = enc_.size(in.size());
+      if (n == 0) {
+        enc_.Encode(in, nullptr);
+        return;
+      }
+      PP_TRACE_SPAN("text:encode");
+      enc_.Encode(in, nf7->value.set_string(ctx->value, n));
+    } else {
+      const auto in = p.v.stringOrVector();
+      buf_.resize(dec_.capacity(in.size()));
+
+      size_t n;
+      {
+        PP_TRACE_SPAN("text:decode");
+        n = dec_.Decode(in, buf_.data());
+      }
+      if (n == 0) return;
+      std::memcpy(nf7->value.set_vector(ctx->value, n), buf_.data(), n);
+    }
+    pp::Emit<"out", O>(ctx, ctx->value);
+  }
+  void Handle(nf7_ctx_t* ctx, const End&) {
+    if (encode_) {
+      const auto n = enc_.finalSize();
+      if (n == 0) return;
+      enc_.Finalize(nf7->value.set_string(ctx->value, n));
+    } else {
+      uint8_t tail[2];
+      const auto n = dec_.Finalize(tail);
+      if (n == 0) return;
+      std::memcpy(nf7->value.set_vector(ctx->value, n), tail, n);
+    }
+    pp::Emit<"out", O>(ctx, ctx->value);
+  }
+  void Handle(nf7_ctx_t*, const Reset&) {
+    enc_ = Encoder {fmt_};
+    dec_ = Decoder {fmt_};
+  }
+
+  static Format ParseFormat(std::string_view name) {
+    if (name == "base64")    return kBase64;
+    if (name == "base64url") return kBase64Url;
+    if (name == "hex")       return kHex;
+    throw std::runtime_error {"unknown format (base64, base64url or hex)"};
+  }
+
+ private:
+  pp::Queue<V> q_ {"text:wait"};
+
+  const bool encode_;
+  Format     fmt_ = kBase64;
+
+  Encoder enc_;
+  Decoder dec_;
+
+  std::vector<uint8_t> buf_;
+};
+
+}  // namespace
+
+
+static void* init_encode() noexcept {
+  return new Context {true};
+}
+static void* init_decode() noexcept {
+  return new Context {false};
+}
+static void deinit(void* ptr) noexcept {
+  delete reinterpret_cast<Context*>(ptr);
+}
+
+static void handle(const nf7_node_msg_t* in) noexcept
+try {
+  PP_TRACE_SPAN("text:recv");
+  auto  v   = pp::ConstValue {in->value};
+  auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
+  I::Dispatch(in->name, [&](pp::In<"start">) {
+    ctx.Push(in->ctx, Context::Start {.fmt = Context::ParseFormat(v.string())});
+  }, [&](pp::In<"in">) {
+    ctx.Push(in->ctx, Context::Exec {.v = v});
+  }, [&](pp::In<"end">) {
+    ctx.Push(in->ctx, Context::End {});
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  });
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  pp::Emit<"error", O>(in->ctx, in->value);
+}
@@ -0,0 +1,17 @@
+#include "nf7.hh"
+
+#include "common/trace.hh"
+
+
+static void* init() noexcept { return nullptr; }
+static void deinit(void*) noexcept { }
+
+extern "C" const nf7_node_t codec_trace = {
+  .name    = "codec_trace",
+  .desc    = "records spans of passpawn-codec nodes and dumps them in Chrome trace format",
+  .inputs  = pp::trace::Inputs::kList,
+  .outputs = pp::trace::Outputs::kList,
+  .init    = init,
+  .deinit  = deinit,
+  .handle  = pp::trace::Handle,
+};
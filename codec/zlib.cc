@@ -1,17 +1,25 @@
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <variant>
+#include <vector>
 
 #include <zlib-ng.h>
 
 #include "nf7.hh"
 
+#include "common/memory.hh"
+#include "common/node.hh"
 #include "common/queue.hh"
+#include "common/timer.hh"
+#include "common/trace.hh"
 #include "common/value.hh"
 
-using namespace std::literals;
+#include "codec/zlib.hh"
 
 
 static void* init() noexcept;
@@ -20,15 +28,15 @@ static void handle_deflate(const nf7_node_msg_t*) noexcept;
 static void handle_inflate(const nf7_node_msg_t*) noexcept;
 
 
-static const char* I_inflate[] = {"init", "in", nullptr};
-static const char* I_deflate[] = {"start", "in", "end", nullptr};
-static const char* O        [] = {"out", "error", nullptr};
+using I_inflate = pp::Sockets<"init", "in", "abort", "stat">;
+using I_deflate = pp::Sockets<"start", "in", "flush", "end", "abort", "stat">;
+using O         = pp::Sockets<"out", "stat", "error">;
 
 extern "C" const nf7_node_t zlib_inflate = {
   .name    = "zlib_inflate",
   .desc    = "inflates a gzip stream by zlib",
-  .inputs  = I_inflate,
-  .outputs = O,
+  .inputs  = I_inflate::kList,
+  .outputs = O::kList,
   .init    = init,
   .deinit  = deinit,
   .handle  = handle_inflate,
@@ -36,24 +44,42 @@ extern "C" const nf7_node_t zlib_inflate = {
 extern "C" const nf7_node_t zlib_deflate = {
   .name    = "zlib_deflate",
   .desc    = "deflates a byte stream by zlib",
-  .inputs  = I_deflate,
-  .outputs = O,
+  .inputs  = I_deflate::kList,
+  .outputs = O::kList,
   .init    = init,
   .deinit  = deinit,
   .handle  = handle_deflate,
 };
 
 
+namespace {
+
+// flushes deflation automatically when either limit of unflushed input is exceeded
+struct FlushPolicy final {
+  int      mode  = Z_SYNC_FLUSH;
+  size_t   bytes = 0;
+  uint64_t ms    = 0;
+};
+
 struct Context {
  public:
-  struct InflateInit final { };
+  struct InflateInit final {
+    int wbits = MAX_WBITS;
+  };
   struct InflateExec final {
     pp::UniqValue v;
   };
   struct DeflateInit final {
     int lv;
+    int wbits = MAX_WBITS;
+
+    FlushPolicy flush = {};
+
+    // the node's context, which outlives the flush timer
+    nf7_ctx_t* ctx = nullptr;
 
-    DeflateInit(int l) : lv(l) {
+    DeflateInit(int l, int w = MAX_WBITS, FlushPolicy f = {}) :
+        lv(l), wbits(w), flush(f) {
       if (lv < -1 || 9 < lv) {
         throw std::runtime_error {"compression level is out of range (0~9 or -1)"};
       }
@@ -62,114 +88,156 @@ struct Context {
   struct DeflateExec final {
     pp::UniqValue v;
   };
+  struct DeflateFlush final {
+    int mode;
+
+    // a flush by the timer is dropped if the stream has been replaced since armed
+    std::optional<pp::AbortSignal::Token> timer = std::nullopt;
+  };
   struct DeflateEnd final {
   };
+  struct Reset final {
+  };
   using V = std::variant<
-      InflateInit, InflateExec, DeflateInit, DeflateExec, DeflateEnd>;
+      InflateInit, InflateExec,
+      DeflateInit, DeflateExec, DeflateFlush, DeflateEnd,
+      Reset>;
 
-  ~Context() noexcept {
-    TearDown();
-  }
   void operator()(nf7_ctx_t* ctx, const V& v) noexcept
   try {
+    PP_TRACE_SPAN("zlib:handle");
     std::visit([&](auto& v) { Handle(ctx, v); }, v);
+  } catch (pp::Aborted&) {
   } catch (std::runtime_error& e) {
     pp::MutValue {ctx->value} = e.what();
-    nf7->ctx.exec_emit(ctx, "error", ctx->value, 0);
+    pp::Emit<"error", O>(ctx, ctx->value);
   }
   void Push(nf7_ctx_t* ctx, V&& v) noexcept {
     q_.PushAndVisit<Context>(ctx, std::move(v));
   }
+  // drops pending inputs and the current stream with its remaining output
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, Reset {});
+  }
+  void EmitStat(nf7_ctx_t* ctx, nf7_value_t* v) noexcept {
+    pp::EmitMemoryStat<O>(ctx, v, streams_.pool());
+  }
 
-  void Handle(nf7_ctx_t*, const InflateInit&) {
-    TearDown();
-    st_.zalloc = Z_NULL;
-    st_.zfree  = Z_NULL;
-    st_.opaque = Z_NULL;
-    if (Z_OK != zng_inflateInit(&st_)) {
-      throw std::runtime_error {st_.msg};
-    }
-    status_ = kInflate;
+  void Handle(nf7_ctx_t*, const InflateInit& p) {
+    Acquire(pp::zlib::Stream::kInflate, 0, p.wbits);
   }
   void Handle(nf7_ctx_t* ctx, const InflateExec& p) {
-    if (status_ != kInflate) {
+    if (!cur_ || cur_->kind != pp::zlib::Stream::kInflate) {
       Handle(ctx, InflateInit {});
     }
-    const auto buf = p.v.vectorOrString();
-    st_.next_in  = buf.data();
-    st_.avail_in = static_cast<uint32_t>(buf.size());
+    cur_->SetInput(p.v.vectorOrString());
     Feed(ctx, zng_inflate, Z_NO_FLUSH);
   }
 
   void Handle(nf7_ctx_t*, const DeflateInit& p) {
-    TearDown();
-    st_.zalloc = Z_NULL;
-    st_.zfree  = Z_NULL;
-    st_.opaque = Z_NULL;
-    if (Z_OK != zng_deflateInit(&st_, p.lv)) {
-      throw std::runtime_error {st_.msg};
-    }
-    status_ = kDeflate;
+    Acquire(pp::zlib::Stream::kDeflate, p.lv, p.wbits);
+    StopTimer();
+    flush_     = p.flush;
+    nctx_      = p.ctx;
+    unflushed_ = 0;
   }
   void Handle(nf7_ctx_t* ctx, const DeflateExec& p) {
-    if (status_ != kDeflate) {
+    if (!cur_ || cur_->kind != pp::zlib::Stream::kDeflate) {
       Handle(ctx, DeflateInit {6});
     }
     const auto buf = p.v.vectorOrString();
-    st_.next_in  = buf.data();
-    st_.avail_in = static_cast<uint32_t>(buf.size());
+    cur_->SetInput(buf);
     Feed(ctx, zng_deflate, Z_NO_FLUSH);
+
+    unflushed_ += buf.size();
+    if (unflushed_ == 0) return;
+    if (flush_.bytes > 0 && unflushed_ >= flush_.bytes) {
+      Handle(ctx, DeflateFlush {.mode = flush_.mode});
+    } else if (flush_.ms > 0 && nctx_ && !armed_) {
+      StartTimer();
+    }
+  }
+  void Handle(nf7_ctx_t* ctx, const DeflateFlush& p) {
+    if (p.timer) {
+      if (p.timer->aborted()) return;
+      armed_ = false;
+      if (unflushed_ == 0) return;
+    }
+    if (!cur_ || cur_->kind != pp::zlib::Stream::kDeflate) {
+      if (p.timer) return;
+      throw std::runtime_error {"deflation not started"};
+    }
+    Feed(ctx, zng_deflate, p.mode);
+    unflushed_ = 0;
   }
   void Handle(nf7_ctx_t* ctx, const DeflateEnd&) {
-    if (status_ != kDeflate) {
+    if (!cur_ || cur_->kind != pp::zlib::Stream::kDeflate) {
       throw std::runtime_error {"deflation not started"};
     }
     Feed(ctx, zng_deflate, Z_FINISH);
-    TearDown();
+    streams_.Release(std::move(cur_));
+    StopTimer();
+    unflushed_ = 0;
+  }
+  void Handle(nf7_ctx_t*, const Reset&) {
+    // a stream aborted in the middle is reset by the next Acquire
+    streams_.Release(std::move(cur_));
+    StopTimer();
+    unflushed_ = 0;
   }
 
  private:
-  pp::Queue<V> q_;
+  pp::Queue<V> q_ {"zlib:wait"};
 
-  enum { kInitial, kInflate, kDeflate, } status_;
-  zng_stream st_;
+  pp::zlib::StreamPool streams_;
+  std::unique_ptr<pp::zlib::Stream> cur_;
 
+  FlushPolicy flush_;
+  size_t      unflushed_ = 0;
 
-  void TearDown() noexcept {
-    switch (status_) {
-    case kInflate: zng_inflateEnd(&st_); break;
-    case kDeflate: zng_deflateEnd(&st_); break;
-    default: break;
-    }
-    status_ = kInitial;
+  // the timer thread starts at the first use, and is joined
+  // before other members are destroyed
+  nf7_ctx_t*      nctx_  = nullptr;
+  bool            armed_ = false;
+  pp::AbortSignal timer_epoch_;
+  std::unique_ptr<pp::Timer> timer_;
+
+
+  void Acquire(pp::zlib::Stream::Kind kind, int lv, int wbits) {
+    streams_.Release(std::move(cur_));
+    cur_ = streams_.Acquire(kind, lv, wbits);
+  }
+  void StartTimer() {
+    if (!timer_) timer_ = std::make_unique<pp::Timer>();
+    armed_ = true;
+    timer_->Start(std::chrono::milliseconds {flush_.ms},
+                  [this, ctx = nctx_, mode = flush_.mode, token = timer_epoch_.token()]() {
+      Push(ctx, DeflateFlush {.mode = mode, .timer = token});
+    });
+  }
+  // firings already queued are dropped by the token
+  void StopTimer() noexcept {
+    timer_epoch_.Abort();
+    armed_ = false;
+    if (timer_) timer_->Cancel();
   }
-  void Feed(nf7_ctx_t* ctx, auto f, auto p) {
-    for (st_.avail_out = 0; st_.avail_out == 0;) {
-      uint8_t buf[1024];
-
-      st_.next_out  = buf;
-      st_.avail_out = sizeof(buf);
-
-      const int ret = f(&st_, p);
-      if (ret == Z_STREAM_ERROR ||
-          ret == Z_NEED_DICT    ||
-          ret == Z_DATA_ERROR   ||
-          ret == Z_MEM_ERROR) {
-        throw std::runtime_error {st_.msg};
-      }
 
-      const auto n = sizeof(buf) - st_.avail_out;
-      if (n > 0) {
-        auto dst = nf7->value.set_vector(ctx->value, n);
-        std::memcpy(dst, buf, n);
-        nf7->ctx.exec_emit(ctx, "out", ctx->value, 0);
-      }
+  void Feed(nf7_ctx_t* ctx, auto f, int flush) {
+    uint8_t buf[1024];
+    cur_->Feed(f, flush, buf, [&](auto out) {
+      q_.token().ThrowIfAborted();
 
-      if (ret == Z_STREAM_END) break;
-    }
+      PP_TRACE_SPAN("zlib:emit");
+      auto dst = nf7->value.set_vector(ctx->value, out.size());
+      std::memcpy(dst, out.data(), out.size());
+      pp::Emit<"out", O>(ctx, ctx->value);
+    });
   }
 };
 
+}  // namespace
+
 
 static void* init() noexcept {
   return new Context;
@@ -178,27 +246,78 @@ static void deinit(void* ptr) noexcept {
   delete reinterpret_cast<Context*>(ptr);
 }
 
-static void handle_inflate(const nf7_node_msg_t* in) noexcept {
+// 'sync' makes the output so far decodable, 'full' also resets the dictionary
+// so that a reader can restart from the point
+static int ParseFlushMode(const pp::ConstValue& v) {
+  if (v.type() == NF7_PULSE) return Z_SYNC_FLUSH;
+
+  const auto str = v.string();
+  if (str == "sync") return Z_SYNC_FLUSH;
+  if (str == "full") return Z_FULL_FLUSH;
+  throw std::runtime_error {"unknown flush mode (sync or full)"};
+}
+
+
+static void handle_inflate(const nf7_node_msg_t* in) noexcept
+try {
+  PP_TRACE_SPAN("zlib_inflate:recv");
+  auto  v   = pp::ConstValue(in->value);
   auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
-  if (in->name == "init"s) {
-    ctx.Push(in->ctx, Context::InflateInit {});
-  } else if (in->name == "in"s) {
-    ctx.Push(in->ctx, Context::InflateExec {.v = in->value});
-  }
+  I_inflate::Dispatch(in->name, [&](pp::In<"init">) {
+    Context::InflateInit p;
+    if (v.type() == NF7_TUPLE) {
+      p.wbits = pp::zlib::ParseWindowBits(v, true);
+    }
+    ctx.Push(in->ctx, std::move(p));
+  }, [&](pp::In<"in">) {
+    ctx.Push(in->ctx, Context::InflateExec {.v = v});
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  }, [&](pp::In<"stat">) {
+    ctx.EmitStat(in->ctx, in->value);
+  });
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  pp::Emit<"error", O>(in->ctx, in->value);
 }
 
 static void handle_deflate(const nf7_node_msg_t* in) noexcept
 try {
+  PP_TRACE_SPAN("zlib_deflate:recv");
   auto  v   = pp::ConstValue(in->value);
   auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
-  if (in->name == "start"s) {
-    ctx.Push(in->ctx, Context::DeflateInit {v.integerOrScalar<int>()});
-  } else if (in->name == "in"s) {
+  I_deflate::Dispatch(in->name, [&](pp::In<"start">) {
+    if (v.type() == NF7_TUPLE) {
+      FlushPolicy flush;
+      if (auto m = v.find("flush")) {
+        flush.mode = ParseFlushMode(*m);
+      }
+      if (auto b = v.find("flush_bytes")) {
+        flush.bytes = b->integerOrScalar<size_t>();
+      }
+      if (auto ms = v.find("flush_ms")) {
+        flush.ms = ms->integerOrScalar<uint64_t>();
+      }
+      const auto lv = v.find("level");
+      Context::DeflateInit p {
+        lv? lv->integerOrScalar<int>(): 6, pp::zlib::ParseWindowBits(v, false), flush};
+      p.ctx = in->ctx;
+      ctx.Push(in->ctx, std::move(p));
+    } else {
+      ctx.Push(in->ctx, Context::DeflateInit {v.integerOrScalar<int>()});
+    }
+  }, [&](pp::In<"in">) {
     ctx.Push(in->ctx, Context::DeflateExec {.v = v});
-  } else if (in->name == "end"s) {
+  }, [&](pp::In<"flush">) {
+    ctx.Push(in->ctx, Context::DeflateFlush {.mode = ParseFlushMode(v)});
+  }, [&](pp::In<"end">) {
     ctx.Push(in->ctx, Context::DeflateEnd {});
-  }
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  }, [&](pp::In<"stat">) {
+    ctx.EmitStat(in->ctx, in->value);
+  });
 } catch (std::exception& e) {
   pp::MutValue {in->value} = e.what();
-  nf7->ctx.exec_emit(in->ctx, "error", in->value, 0);
+  pp::Emit<"error", O>(in->ctx, in->value);
 }
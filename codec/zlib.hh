@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib-ng.h>
+
+#include "common/memory.hh"
+#include "common/trace.hh"
+#include "common/value.hh"
+
+
+namespace pp::zlib {
+
+// an initialized stream, which is reset to be reused
+// while the parameters are unchanged
+struct Stream final {
+ public:
+  enum Kind { kInflate, kDeflate, };
+
+  Stream(Pool& pool, Kind k, int l, int w) : kind(k), lv(l), wbits(w) {
+    st.zalloc   = Pool::ZAlloc;
+    st.zfree    = Pool::ZFree;
+    st.opaque   = &pool;
+    st.next_in  = nullptr;
+    st.avail_in = 0;
+
+    const int ret = kind == kInflate?
+        zng_inflateInit2(&st, wbits):
+        zng_deflateInit2(&st, lv, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+      throw std::runtime_error {st.msg? st.msg: "failed to init zlib stream"};
+    }
+  }
+  ~Stream() noexcept {
+    kind == kInflate? zng_inflateEnd(&st): zng_deflateEnd(&st);
+  }
+  Stream(const Stream&) = delete;
+  Stream(Stream&&) = delete;
+  Stream& operator=(const Stream&) = delete;
+  Stream& operator=(Stream&&) = delete;
+
+  bool Reset() noexcept {
+    return Z_OK == (kind == kInflate? zng_inflateReset(&st): zng_deflateReset(&st));
+  }
+
+  void SetInput(std::span<const uint8_t> buf) noexcept {
+    st.next_in  = buf.data();
+    st.avail_in = static_cast<uint32_t>(buf.size());
+  }
+
+  // calls f (zng_inflate or zng_deflate) until the output stops filling buf,
+  // passing each output to emit, and returns true when the stream ended
+  template <typename F, typename E>
+  bool Feed(F f, int flush, std::span<uint8_t> buf, E&& emit) {
+    for (st.avail_out = 0; st.avail_out == 0;) {
+      PP_TRACE_SPAN("zlib:feed");
+      st.next_out  = buf.data();
+      st.avail_out = static_cast<uint32_t>(buf.size());
+
+      const int ret = f(&st, flush);
+      if (ret == Z_STREAM_ERROR ||
+          ret == Z_NEED_DICT    ||
+          ret == Z_DATA_ERROR   ||
+          ret == Z_MEM_ERROR) {
+        throw std::runtime_error {st.msg? st.msg: "zlib error"};
+      }
+
+      const auto n = buf.size() - st.avail_out;
+      if (n > 0) {
+        emit(buf.first(n));
+      }
+      if (ret == Z_STREAM_END) return true;
+    }
+    return false;
+  }
+
+  const Kind kind;
+  const int  lv;
+  const int  wbits;
+
+  // zlib keeps a pointer to this, so Stream is never moved
+  zng_stream st;
+};
+
+
+// keeps released streams to be reset and reused by the following Acquire
+struct StreamPool final {
+ public:
+  static constexpr size_t kMaxIdle = 4;
+
+  StreamPool() = default;
+  StreamPool(const StreamPool&) = delete;
+  StreamPool(StreamPool&&) = delete;
+  StreamPool& operator=(const StreamPool&) = delete;
+  StreamPool& operator=(StreamPool&&) = delete;
+
+  std::unique_ptr<Stream> Acquire(Stream::Kind kind, int lv, int wbits) {
+    auto itr = std::find_if(idle_.begin(), idle_.end(), [&](auto& s) {
+      return s->kind == kind && s->lv == lv && s->wbits == wbits;
+    });
+    if (itr != idle_.end()) {
+      auto s = std::move(*itr);
+      idle_.erase(itr);
+      if (s->Reset()) return s;
+    }
+    return std::make_unique<Stream>(pool_, kind, lv, wbits);
+  }
+  void Release(std::unique_ptr<Stream>&& s) noexcept
+  try {
+    if (!s) return;
+    if (idle_.size() >= kMaxIdle) {
+      idle_.erase(idle_.begin());
+    }
+    idle_.push_back(std::move(s));
+  } catch (std::bad_alloc&) {
+    s = nullptr;
+  }
+
+  const Pool& pool() const noexcept { return pool_; }
+
+ private:
+  // declared first to be destroyed after all streams
+  Pool pool_;
+
+  std::vector<std::unique_ptr<Stream>> idle_;
+};
+
+
+// parses window bits from a tuple with optional fields, 'wbits' (8~15) and
+// 'format' ('zlib', 'gzip', 'raw' or, only for inflation, 'auto')
+inline int ParseWindowBits(const ConstValue& v, bool inflate) {
+  int wbits = MAX_WBITS;
+  if (auto w = v.find("wbits")) {
+    wbits = w->integerOrScalar<int>();
+    if (wbits < 8 || 15 < wbits) {
+      throw std::runtime_error {"wbits is out of range (8~15)"};
+    }
+  }
+  if (auto f = v.find("format")) {
+    const auto fmt = f->string();
+    if (fmt == "zlib") {
+    } else if (fmt == "gzip") {
+      wbits += 16;
+    } else if (fmt == "raw") {
+      wbits = -wbits;
+    } else if (fmt == "auto" && inflate) {
+      wbits += 32;
+    } else {
+      throw std::runtime_error {"unknown format"};
+    }
+  }
+  return wbits;
+}
+
+}  // namespace pp::zlib
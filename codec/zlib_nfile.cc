@@ -0,0 +1,332 @@
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include <zlib-ng.h>
+
+#include "nf7.hh"
+
+#include "common/memory.hh"
+#include "common/node.hh"
+#include "common/queue.hh"
+#include "common/trace.hh"
+#include "common/value.hh"
+
+#include "codec/zlib.hh"
+
+
+static void* init() noexcept;
+static void deinit(void*) noexcept;
+static void handle(const nf7_node_msg_t*) noexcept;
+
+using I = pp::Sockets<"open", "read", "close", "abort", "stat">;
+using O = pp::Sockets<"out", "done", "stat", "error">;
+extern "C" const nf7_node_t zlib_nfile_read = {
+  .name    = "zlib_nfile_read",
+  .desc    = "reads and inflates a compressed native file in one stage",
+  .inputs  = I::kList,
+  .outputs = O::kList,
+  .init    = init,
+  .deinit  = deinit,
+  .handle  = handle,
+};
+
+
+namespace {
+
+// reads blocks of a file on a background thread,
+// so that the next block is being read while the previous one is inflated
+struct ReadAhead final {
+ public:
+  ReadAhead(std::ifstream& st, size_t block) : st_(st) {
+    for (auto& b : bufs_) b.buf.resize(block);
+    th_ = std::thread {[this]() { Main(); }};
+  }
+  ~ReadAhead() noexcept {
+    {
+      std::unique_lock<std::mutex> k {mtx_};
+      quit_ = true;
+    }
+    cv_.notify_all();
+    th_.join();
+  }
+  ReadAhead(const ReadAhead&) = delete;
+  ReadAhead(ReadAhead&&) = delete;
+  ReadAhead& operator=(const ReadAhead&) = delete;
+  ReadAhead& operator=(ReadAhead&&) = delete;
+
+  // returns the next block, which is valid until the next call,
+  // or an empty span at the end of file
+  std::span<const uint8_t> Next() {
+    std::unique_lock<std::mutex> k {mtx_};
+    if (std::exchange(taken_, false)) {
+      bufs_[r_].filled = false;
+      r_ = (r_+1)%2;
+      cv_.notify_all();
+    }
+    cv_.wait(k, [&]() { return bufs_[r_].filled || end_; });
+
+    auto& b = bufs_[r_];
+    if (b.filled) {
+      taken_ = true;
+      return {b.buf.data(), b.size};
+    }
+    if (failed_) throw std::runtime_error {"failed to read"};
+    return {};
+  }
+
+ private:
+  struct Buffer final {
+    std::vector<uint8_t> buf;
+    size_t size   = 0;
+    bool   filled = false;
+  };
+
+  std::ifstream& st_;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  Buffer bufs_[2];
+  size_t r_      = 0;
+  bool   taken_  = false;
+  bool   end_    = false;
+  bool   failed_ = false;
+  bool   quit_   = false;
+
+  std::thread th_;
+
+
+  void Main() noexcept {
+    for (size_t w = 0;; w = (w+1)%2) {
+      auto& b = bufs_[w];
+      {
+        std::unique_lock<std::mutex> k {mtx_};
+        cv_.wait(k, [&]() { return !b.filled || quit_; });
+        if (quit_) return;
+      }
+
+      // the consumer never touches a buffer not filled
+      PP_TRACE_SPAN("zlib_nfile_read:read");
+      st_.read(reinterpret_cast<char*>(b.buf.data()),
+               static_cast<std::streamsize>(b.buf.size()));
+      const auto n = static_cast<size_t>(st_.gcount());
+
+      std::unique_lock<std::mutex> k {mtx_};
+      if (n > 0) {
+        b.size   = n;
+        b.filled = true;
+      }
+      if (!st_) {
+        end_    = true;
+        failed_ = st_.bad();
+      }
+      cv_.notify_all();
+      if (end_) return;
+    }
+  }
+};
+
+
+struct Context final {
+ public:
+  // bytes of the compressed file read at once
+  static constexpr size_t kBlock = 256*1024;
+  // max bytes of the decompressed data emitted at once
+  static constexpr size_t kChunk = 256*1024;
+
+  struct Open final {
+    std::filesystem::path npath;
+    int wbits;
+  };
+  struct Read final { };
+  struct Close final { };
+  struct AbortClose final { };  // closes without 'done'
+  using V = std::variant<Open, Read, Close, AbortClose>;
+
+  void operator()(nf7_ctx_t* ctx, const V& v) noexcept
+  try {
+    PP_TRACE_SPAN("zlib_nfile_read:handle");
+    std::visit([&](auto& v) { Handle(ctx, v); }, v);
+    if (std::holds_alternative<AbortClose>(v)) return;
+    pp::MutValue {ctx->value} = pp::MutValue::Pulse {};
+    pp::Emit<"done", O>(ctx, ctx->value);
+  } catch (pp::Aborted&) {
+  } catch (std::exception& e) {
+    pp::MutValue {ctx->value} = e.what();
+    pp::Emit<"error", O>(ctx, ctx->value);
+  }
+  void Push(nf7_ctx_t* ctx, V&& v) noexcept {
+    q_.PushAndVisit<Context>(ctx, std::move(v));
+  }
+  // drops pending reads and stops the current one at the next block
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, AbortClose {});
+  }
+  void EmitStat(nf7_ctx_t* ctx, nf7_value_t* v) noexcept {
+    pp::EmitMemoryStat<O>(ctx, v, streams_.pool());
+  }
+
+  void Handle(nf7_ctx_t*, const Open& p) {
+    st_ = std::nullopt;
+    st_.emplace(p.npath, std::ios::binary);
+    if (!*st_) {
+      st_ = std::nullopt;
+      throw std::runtime_error {"failed to open"};
+    }
+    wbits_ = p.wbits;
+  }
+  void Handle(nf7_ctx_t* ctx, const Read&) {
+    if (!st_) throw std::runtime_error {"not opened"};
+
+    auto s = streams_.Acquire(pp::zlib::Stream::kInflate, 0, wbits_);
+
+    // inflates directly into the value to be emitted
+    uint8_t* out    = nf7->value.set_vector(ctx->value, kChunk);
+    size_t   filled = 0;
+
+    // the file is closed whatever happens, and the data inflated before
+    // an error is still emitted
+    bool ended;
+    try {
+      ended = Inflate(ctx, *s, out, filled);
+    } catch (pp::Aborted&) {
+      Finish(std::move(s));
+      throw;
+    } catch (...) {
+      EmitRest(ctx, out, filled);
+      Finish(std::move(s));
+      throw;
+    }
+    EmitRest(ctx, out, filled);
+    Finish(std::move(s));
+
+    if (!ended) throw std::runtime_error {"unexpected end of file"};
+  }
+  void Handle(nf7_ctx_t*, const Close&) {
+    st_ = std::nullopt;
+  }
+  void Handle(nf7_ctx_t* ctx, const AbortClose&) {
+    Handle(ctx, Close {});
+  }
+
+ private:
+  pp::Queue<V> q_ {"zlib_nfile_read:wait"};
+
+  pp::zlib::StreamPool streams_;
+
+  std::optional<std::ifstream> st_;
+  int wbits_ = MAX_WBITS+32;
+
+  std::vector<uint8_t> tail_;
+
+
+  // returns true if the last member has ended
+  bool Inflate(nf7_ctx_t* ctx, pp::zlib::Stream& s, uint8_t*& out, size_t& filled) {
+    ReadAhead ra {*st_, kBlock};
+    auto& zs = s.st;
+
+    bool ended = false;
+    for (auto in = ra.Next(); !in.empty(); in = ra.Next()) {
+      q_.token().ThrowIfAborted();
+      s.SetInput(in);
+      for (;;) {
+        if (ended) {
+          // another gzip member may follow, and other bytes such as
+          // padding of a tape block are ignored
+          if (zs.avail_in == 0) break;
+          if (*zs.next_in != 0x1f) return true;
+          if (!s.Reset()) throw std::runtime_error {"failed to reset zlib stream"};
+        }
+
+        PP_TRACE_SPAN("zlib:feed");
+        zs.next_out  = out + filled;
+        zs.avail_out = static_cast<uint32_t>(kChunk - filled);
+
+        const int ret = zng_inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+          throw std::runtime_error {zs.msg? zs.msg: "zlib error"};
+        }
+        filled = kChunk - zs.avail_out;
+        ended  = ret == Z_STREAM_END;
+
+        const bool full = filled == kChunk;
+        if (full) {
+          q_.token().ThrowIfAborted();
+
+          PP_TRACE_SPAN("zlib:emit");
+          pp::Emit<"out", O>(ctx, ctx->value);
+          out    = nf7->value.set_vector(ctx->value, kChunk);
+          filled = 0;
+        }
+        if (zs.avail_in == 0 && !full) break;
+      }
+    }
+    return ended;
+  }
+  void EmitRest(nf7_ctx_t* ctx, const uint8_t* out, size_t filled) {
+    if (filled == 0) return;
+    tail_.assign(out, out+filled);
+    auto dst = nf7->value.set_vector(ctx->value, filled);
+    std::memcpy(dst, tail_.data(), filled);
+
+    PP_TRACE_SPAN("zlib:emit");
+    pp::Emit<"out", O>(ctx, ctx->value);
+  }
+  void Finish(std::unique_ptr<pp::zlib::Stream>&& s) noexcept {
+    streams_.Release(std::move(s));
+    st_ = std::nullopt;
+  }
+};
+
+}  // namespace
+
+
+static void* init() noexcept {
+  return new Context;
+}
+static void deinit(void* ptr) noexcept {
+  delete reinterpret_cast<Context*>(ptr);
+}
+
+static void handle(const nf7_node_msg_t* in) noexcept
+try {
+  PP_TRACE_SPAN("zlib_nfile_read:recv");
+  auto  v   = pp::ConstValue {in->value};
+  auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
+  I::Dispatch(in->name, [&](pp::In<"open">) {
+    switch (v.type()) {
+    case NF7_STRING:
+      ctx.Push(in->ctx, Context::Open {.npath = v.string(), .wbits = MAX_WBITS+32});
+      break;
+    case NF7_TUPLE:
+      ctx.Push(in->ctx, Context::Open {
+        .npath = v["npath"].string(),
+        .wbits = v.find("format") || v.find("wbits")?
+            pp::zlib::ParseWindowBits(v, true): MAX_WBITS+32,
+      });
+      break;
+    default:
+      throw std::runtime_error {"invalid input"};
+    }
+  }, [&](pp::In<"read">) {
+    ctx.Push(in->ctx, Context::Read {});
+  }, [&](pp::In<"close">) {
+    ctx.Push(in->ctx, Context::Close {});
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  }, [&](pp::In<"stat">) {
+    ctx.EmitStat(in->ctx, in->value);
+  });
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  pp::Emit<"error", O>(in->ctx, in->value);
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "nf7.hh"
+
+#include "common/node.hh"
+#include "common/value.hh"
+
+
+namespace pp {
+
+// counts live and peak bytes
+struct MemoryMeter final {
+ public:
+  void Add(size_t n) noexcept {
+    UpdatePeak(live_.fetch_add(n, std::memory_order_relaxed) + n);
+  }
+  // adds n only if live bytes stay within the cap, in one atomic step
+  bool TryAdd(size_t n, size_t cap) noexcept {
+    auto live = live_.load(std::memory_order_relaxed);
+    do {
+      if (n > cap || live > cap-n) return false;
+    } while (!live_.compare_exchange_weak(live, live+n, std::memory_order_relaxed));
+    UpdatePeak(live+n);
+    return true;
+  }
+  void Sub(size_t n) noexcept {
+    live_.fetch_sub(n, std::memory_order_relaxed);
+  }
+
+  size_t live() const noexcept { return live_.load(std::memory_order_relaxed); }
+  size_t peak() const noexcept { return peak_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<size_t> live_ = 0;
+  std::atomic<size_t> peak_ = 0;
+
+  void UpdatePeak(size_t now) noexcept {
+    auto peak = peak_.load(std::memory_order_relaxed);
+    while (peak < now &&
+           !peak_.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+    }
+  }
+};
+
+
+// all pools in the library share this meter and the cap,
+// which is taken from an environment variable PASSPAWN_MEMORY_CAP (in bytes)
+struct GlobalMemory final {
+ public:
+  static MemoryMeter& meter() noexcept {
+    static MemoryMeter m;
+    return m;
+  }
+  static size_t cap() noexcept {
+    static const size_t c = []() -> size_t {
+      const char* env = std::getenv("PASSPAWN_MEMORY_CAP");
+      return env? std::strtoull(env, nullptr, 10): 0;
+    }();
+    return c;
+  }
+
+  static bool Acquire(size_t n) noexcept {
+    const auto c = cap();
+    if (c == 0) {
+      meter().Add(n);
+      return true;
+    }
+    return meter().TryAdd(n, c);
+  }
+  static void Release(size_t n) noexcept {
+    meter().Sub(n);
+  }
+};
+
+
+// A thread-safe allocator which keeps freed blocks in size classes to be
+// reused by the next allocation, and measures bytes in use.
+// Kept blocks still count against the global cap, and are released when
+// an allocation of the pool would exceed it.
+// Each block knows its owner pool, so the pool must outlive the blocks.
+struct Pool final {
+ public:
+  // blocks larger than this are directly returned to the system
+  static constexpr size_t kMaxPooled = size_t {1} << 26;
+  // total bytes of free blocks to be kept
+  static constexpr size_t kMaxRetained = size_t {1} << 25;
+
+  Pool() = default;
+  ~Pool() noexcept {
+    Trim();
+  }
+  Pool(const Pool&) = delete;
+  Pool(Pool&&) = delete;
+  Pool& operator=(const Pool&) = delete;
+  Pool& operator=(Pool&&) = delete;
+
+  // returns nullptr when the system is out of memory or the cap is exceeded
+  static void* Alloc(Pool* pool, size_t n) noexcept {
+    const auto size = Round(n);
+
+    void* ptr = pool? pool->Take(size): nullptr;
+    if (!ptr) {
+      if (!GlobalMemory::Acquire(size)) {
+        if (!pool || !pool->Trim() || !GlobalMemory::Acquire(size)) {
+          return nullptr;
+        }
+      }
+      ptr = std::malloc(sizeof(Header) + size);
+      if (!ptr) {
+        GlobalMemory::Release(size);
+        return nullptr;
+      }
+    }
+    if (pool) {
+      pool->meter_.Add(size);
+    }
+    new (ptr) Header {.owner = pool, .size = size};
+    return reinterpret_cast<Header*>(ptr) + 1;
+  }
+  static void Free(void* ptr) noexcept {
+    if (!ptr) return;
+    auto hdr = reinterpret_cast<Header*>(ptr) - 1;
+    if (hdr->owner) {
+      hdr->owner->meter_.Sub(hdr->size);
+      if (hdr->owner->Keep(hdr, hdr->size)) return;
+    }
+    GlobalMemory::Release(hdr->size);
+    std::free(hdr);
+  }
+  static void* Realloc(Pool* pool, void* ptr, size_t n) noexcept {
+    if (!ptr) return Alloc(pool, n);
+
+    const auto hdr = reinterpret_cast<Header*>(ptr) - 1;
+    if (n <= hdr->size) return ptr;
+
+    void* ret = Alloc(hdr->owner, n);
+    if (!ret) return nullptr;
+    std::memcpy(ret, ptr, hdr->size);
+    Free(ptr);
+    return ret;
+  }
+
+  // adapters for zlib's zalloc/zfree, opaque is a pointer to Pool
+  static void* ZAlloc(void* opaque, unsigned items, unsigned size) noexcept {
+    return Alloc(reinterpret_cast<Pool*>(opaque), size_t {items}*size);
+  }
+  static void ZFree(void*, void* ptr) noexcept {
+    Free(ptr);
+  }
+
+  const MemoryMeter& meter() const noexcept { return meter_; }
+
+  // bytes of free blocks kept for reuse
+  size_t retained() const noexcept {
+    std::unique_lock<std::mutex> k {mtx_};
+    return retained_;
+  }
+
+ private:
+  struct alignas(16) Header final {
+    Pool*  owner;
+    size_t size;
+  };
+
+  // 4 classes for each power of two from 64 bytes to kMaxPooled
+  static constexpr size_t kClasses = 1+static_cast<size_t>(std::bit_width(kMaxPooled)-7)*4;
+
+  mutable std::mutex mtx_;
+  std::array<std::vector<void*>, kClasses> free_;
+  size_t retained_ = 0;
+
+  MemoryMeter meter_;
+
+
+  static size_t Round(size_t n) noexcept {
+    if (n <= 64) return 64;
+    const auto step = size_t {1} << (std::bit_width(n-1)-3);
+    return (n+step-1) & ~(step-1);
+  }
+  static size_t IndexOf(size_t size) noexcept {
+    if (size <= 64) return 0;
+    const auto b = std::bit_width(size-1);
+    return 1 + static_cast<size_t>(b-7)*4 + (size >> (b-3)) - 5;
+  }
+
+  void* Take(size_t size) noexcept {
+    if (size > kMaxPooled) return nullptr;
+
+    std::unique_lock<std::mutex> k {mtx_};
+    auto& blocks = free_[IndexOf(size)];
+    if (blocks.empty()) return nullptr;
+
+    auto ret = blocks.back();
+    blocks.pop_back();
+    retained_ -= size;
+    return ret;
+  }
+  // returns false if the caller must free the block
+  bool Keep(void* ptr, size_t size) noexcept
+  try {
+    if (size > kMaxPooled) return false;
+
+    std::unique_lock<std::mutex> k {mtx_};
+    if (retained_+size > kMaxRetained) return false;
+    free_[IndexOf(size)].push_back(ptr);
+    retained_ += size;
+    return true;
+  } catch (std::bad_alloc&) {
+    return false;
+  }
+  // frees all kept blocks, and returns false if there was none
+  bool Trim() noexcept {
+    std::unique_lock<std::mutex> k {mtx_};
+    if (retained_ == 0) return false;
+    for (auto& blocks : free_) {
+      for (auto ptr : blocks) std::free(ptr);
+      blocks.clear();
+    }
+    GlobalMemory::Release(std::exchange(retained_, 0));
+    return true;
+  }
+};
+
+
+// emits a tuple of live and peak bytes of the pool and the whole library
+// from the "stat" socket of O, where global bytes include retained ones
+template <typename O>
+void EmitMemoryStat(nf7_ctx_t* ctx, nf7_value_t* v, const Pool& p) noexcept {
+  static const char* names[] = {
+    "live", "peak", "retained", "global_live", "global_peak", nullptr};
+  nf7_value_t* values[5];
+  MutValue {v}.AllocateTuple(names, values);
+
+  const auto& m = p.meter();
+  const auto& g = GlobalMemory::meter();
+  MutValue {values[0]} = static_cast<int64_t>(m.live());
+  MutValue {values[1]} = static_cast<int64_t>(m.peak());
+  MutValue {values[2]} = static_cast<int64_t>(p.retained());
+  MutValue {values[3]} = static_cast<int64_t>(g.live());
+  MutValue {values[4]} = static_cast<int64_t>(g.peak());
+  Emit<"stat", O>(ctx, v);
+}
+
+}  // namespace pp
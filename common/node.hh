@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "nf7.hh"
+
+
+namespace pp {
+
+// a string literal usable as a template argument
+template <size_t N>
+struct Name final {
+ public:
+  consteval Name(const char (&s)[N]) noexcept {
+    std::copy_n(s, N, str);
+  }
+  constexpr std::string_view view() const noexcept { return {str, N-1}; }
+
+  char str[N];
+};
+
+// a tag type of a socket, which selects a handler by overload resolution
+template <Name kName>
+struct In final {
+  static constexpr std::string_view name = kName.view();
+};
+
+
+// names of node sockets declared once, which generate the table of nf7_node_t
+// and a dispatch by a perfect hash built at compile time
+template <Name... kNames>
+struct Sockets final {
+ public:
+  static constexpr size_t kCount = sizeof...(kNames);
+  static constexpr size_t kNone  = kCount;
+
+  // nullptr-terminated, for inputs or outputs of nf7_node_t
+  static inline const char* kList[] = {kNames.str..., nullptr};
+
+  template <Name kName>
+  static constexpr bool kHas = ((kNames.view() == kName.view()) || ...);
+
+  // index of the name, which must be declared
+  template <Name kName>
+  static constexpr size_t kIndex = [] {
+    constexpr std::string_view names[] = {kNames.view()...};
+    const auto itr = std::find(std::begin(names), std::end(names), kName.view());
+    if (itr == std::end(names)) throw "unknown socket name";
+    return static_cast<size_t>(itr - std::begin(names));
+  }();
+
+  // returns kNone if the name is not declared
+  static size_t Find(const char* name) noexcept {
+    const auto i = kTable[Hash(name) & (kTable.size()-1)];
+    return i != kNone && std::strcmp(kList[i], name) == 0? i: kNone;
+  }
+
+  // calls one of f, which takes In<name> of the received name,
+  // and ignores undeclared names
+  template <typename... F>
+  static void Dispatch(const char* name, F&&... f) {
+    Overload h {std::forward<F>(f)...};
+    static_assert((std::is_invocable_v<decltype(h)&, In<kNames>> && ...),
+                  "every declared socket must be handled");
+    static_assert((kHandlesDeclared<std::decay_t<F>> && ...),
+                  "every handler must take a declared socket");
+
+    const auto i = Find(name);
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (void) ((i == I && (h(In<kNames> {}), true)) || ...);
+    }(std::make_index_sequence<kCount> {});
+  }
+
+ private:
+  template <typename... F>
+  struct Overload final : F... {
+    using F::operator()...;
+  };
+  template <typename... F>
+  Overload(F...) -> Overload<F...>;
+
+  template <typename F>
+  static constexpr bool kHandlesDeclared = (std::is_invocable_v<F&, In<kNames>> || ...);
+
+  // FNV-1a
+  static constexpr uint32_t Hash(const char* s) noexcept {
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) h = (h ^ static_cast<uint8_t>(*s)) * 16777619u;
+    return h;
+  }
+
+  // the smallest power of two slots in which no names collide
+  static constexpr size_t kSlots = [] {
+    constexpr uint32_t hashes[] = {Hash(kNames.str)...};
+    for (size_t n = 1;; n *= 2) {
+      bool used[1024] = {};
+      bool ok = true;
+      for (auto h : hashes) {
+        auto& u = used[h & (n-1)];
+        ok = ok && !u;
+        u  = true;
+      }
+      if (ok) return n;
+      if (n >= 1024) throw "too many sockets";
+    }
+  }();
+  static constexpr std::array<size_t, kSlots> kTable = [] {
+    std::array<size_t, kSlots> ret;
+    ret.fill(kNone);
+    size_t i = 0;
+    ((ret[Hash(kNames.str) & (kSlots-1)] = i++), ...);
+    return ret;
+  }();
+};
+
+
+// emits a value from the output socket, which must be declared in every list
+// of outputs sharing the caller (e.g. reader and writer nodes of one context)
+template <Name kName, typename O, typename... Os>
+void Emit(nf7_ctx_t* ctx, const nf7_value_t* v) noexcept {
+  static_assert(O::template kHas<kName> && (Os::template kHas<kName> && ...),
+                "emitting from an undeclared socket");
+  nf7->ctx.exec_emit(ctx, O::kList[O::template kIndex<kName>], v, 0);
+}
+
+}  // namespace pp
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <exception>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
@@ -7,17 +10,67 @@
 
 #include "nf7.hh"
 
+#include "common/trace.hh"
 #include "common/value.hh"
 
 
 namespace pp {
 
+// thrown by an operation which noticed that it has been aborted,
+// and caught silently by its handler
+struct Aborted final : public std::exception {
+ public:
+  const char* what() const noexcept override { return "aborted"; }
+};
+
+// notifies operations issued before Abort() that they are no longer needed
+struct AbortSignal final {
+ public:
+  struct Token final {
+   public:
+    bool aborted() const noexcept {
+      return epoch_ && epoch_->load(std::memory_order_relaxed) != at_;
+    }
+    // called at each chunk boundary of a long operation
+    void ThrowIfAborted() const {
+      if (aborted()) throw Aborted {};
+    }
+
+   private:
+    friend struct AbortSignal;
+
+    std::shared_ptr<const std::atomic<uint64_t>> epoch_;
+    uint64_t at_ = 0;
+  };
+
+  Token token() const noexcept {
+    Token ret;
+    ret.epoch_ = epoch_;
+    ret.at_    = epoch_->load(std::memory_order_relaxed);
+    return ret;
+  }
+  void Abort() noexcept {
+    epoch_->fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  // shared with tokens held by operations outliving the owner
+  std::shared_ptr<std::atomic<uint64_t>> epoch_ =
+      std::make_shared<std::atomic<uint64_t>>(0);
+};
+
+
 template <typename T>
 struct Queue final {
  public:
+  // the name is recorded as a span of the time items wait in the queue
+  explicit Queue(const char* name) noexcept : name_(name) {
+  }
+
   bool Push(T&& v) noexcept {
+    const auto now = trace::Now();
     std::unique_lock<std::mutex> k {mtx_};
-    q_.push(std::move(v));
+    q_.push(Item {.v = std::move(v), .pushed = now});
     return std::exchange(working_, true);
   }
   std::optional<T> Pop() noexcept {
@@ -28,9 +81,25 @@ struct Queue final {
     }
     auto ret = std::move(q_.front());
     q_.pop();
-    return ret;
+    running_ = abort_.token();
+    k.unlock();
+
+    trace::Record(name_, ret.pushed, trace::Now());
+    return std::move(ret.v);
   }
 
+  // drops all pending items and aborts the item being processed
+  void Abort() noexcept {
+    std::queue<Item> drop;
+    std::unique_lock<std::mutex> k {mtx_};
+    std::swap(drop, q_);
+    abort_.Abort();
+  }
+
+  // a token of the item being processed,
+  // which is valid only on the thread processing it
+  const AbortSignal::Token& token() const noexcept { return running_; }
+
   template <typename U>
   void PushAndVisit(nf7_ctx_t* ctx, T&& v) {
     if (!Push(std::move(v))) {
@@ -45,9 +114,19 @@ struct Queue final {
   }
 
  private:
+  struct Item final {
+    T v;
+    trace::Stamp pushed;
+  };
+
+  const char* name_;
+
   std::mutex mtx_;
-  std::queue<T> q_;
+  std::queue<Item> q_;
   bool working_ = false;
+
+  AbortSignal abort_;
+  AbortSignal::Token running_;
 };
 
 }  // namespace pp
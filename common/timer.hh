@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+
+namespace pp {
+
+// calls a function after a delay on a background thread,
+// and never calls it after destroyed
+struct Timer final {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  Timer() noexcept : th_([this]() { Main(); }) {
+  }
+  ~Timer() noexcept {
+    {
+      std::unique_lock<std::mutex> k {mtx_};
+      alive_ = false;
+    }
+    cv_.notify_all();
+    th_.join();
+  }
+  Timer(const Timer&) = delete;
+  Timer(Timer&&) = delete;
+  Timer& operator=(const Timer&) = delete;
+  Timer& operator=(Timer&&) = delete;
+
+  // replaces the pending function if exists
+  void Start(std::chrono::milliseconds delay, std::function<void()>&& f) noexcept {
+    {
+      std::unique_lock<std::mutex> k {mtx_};
+      at_ = Clock::now() + delay;
+      f_  = std::move(f);
+    }
+    cv_.notify_all();
+  }
+  // a function already running is not stopped
+  void Cancel() noexcept {
+    std::unique_lock<std::mutex> k {mtx_};
+    at_ = std::nullopt;
+    f_  = nullptr;
+  }
+
+ private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+
+  bool alive_ = true;
+  std::optional<Clock::time_point> at_;
+  std::function<void()> f_;
+
+  std::thread th_;
+
+
+  void Main() noexcept {
+    std::unique_lock<std::mutex> k {mtx_};
+    while (alive_) {
+      if (!at_) {
+        cv_.wait(k);
+      } else if (Clock::now() < *at_) {
+        cv_.wait_until(k, *at_);
+      } else {
+        auto f = std::exchange(f_, nullptr);
+        at_ = std::nullopt;
+        k.unlock();
+        f();
+        k.lock();
+      }
+    }
+  }
+};
+
+}  // namespace pp
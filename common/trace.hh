@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "nf7.hh"
+
+#include "common/node.hh"
+#include "common/value.hh"
+
+
+// Spans are recorded only when built with PASSPAWN_TRACE and started at
+// runtime by the trace node. Otherwise PP_TRACE_SPAN expands to nothing.
+#define PP_TRACE_CONCAT2_(a, b) a##b
+#define PP_TRACE_CONCAT_(a, b) PP_TRACE_CONCAT2_(a, b)
+#if defined(PASSPAWN_TRACE)
+# define PP_TRACE_SPAN(name)  \
+    ::pp::trace::Span PP_TRACE_CONCAT_(pp_trace_span_, __LINE__) {name}
+#else
+# define PP_TRACE_SPAN(name) static_cast<void>(0)
+#endif
+
+
+namespace pp::trace {
+
+#if defined(PASSPAWN_TRACE)
+inline constexpr bool kEnabled = true;
+#else
+inline constexpr bool kEnabled = false;
+#endif
+
+// microseconds since an arbitrary epoch, 0 means 'not traced'
+using Stamp = int64_t;
+
+
+#if defined(PASSPAWN_TRACE)
+struct Ring final {
+ public:
+  static constexpr size_t kSize = size_t {1} << 16;
+
+  struct Event final {
+    // odd while being written, 2*(index+1) after committed
+    std::atomic<uint64_t> seq = 0;
+
+    std::atomic<const char*> name  = nullptr;
+    std::atomic<uint32_t>    tid   = 0;
+    std::atomic<int64_t>     begin = 0;
+    std::atomic<int64_t>     dur   = 0;
+  };
+
+  void Record(const char* name, Stamp begin, Stamp end) noexcept {
+    const uint64_t idx = head_.fetch_add(1, std::memory_order_relaxed);
+    auto& e = events_[idx%kSize];
+
+    // the event is dropped if a writer which claimed the slot one lap earlier
+    // is still writing, or one a lap later has already taken it
+    auto seq = e.seq.load(std::memory_order_relaxed);
+    if (seq%2 == 1 || seq > 2*idx ||
+        !e.seq.compare_exchange_strong(seq, 2*idx+1, std::memory_order_relaxed)) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name.store(name, std::memory_order_relaxed);
+    e.tid.store(ThreadId(), std::memory_order_relaxed);
+    e.begin.store(begin, std::memory_order_relaxed);
+    e.dur.store(end - begin, std::memory_order_relaxed);
+    e.seq.store(2*(idx+1), std::memory_order_release);
+  }
+
+  void Dump(std::ostream& st) const noexcept {
+    st << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& e : events_) {
+      const auto seq1 = e.seq.load(std::memory_order_acquire);
+      if (seq1 == 0 || seq1%2 == 1) continue;
+
+      const auto name  = e.name.load(std::memory_order_relaxed);
+      const auto tid   = e.tid.load(std::memory_order_relaxed);
+      const auto begin = e.begin.load(std::memory_order_relaxed);
+      const auto dur   = e.dur.load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq1 != e.seq.load(std::memory_order_relaxed)) continue;
+
+      if (!std::exchange(first, false)) st << ',';
+      st << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":0"
+         << ",\"tid\":" << tid << ",\"ts\":" << begin << ",\"dur\":" << dur << '}';
+    }
+    st << "],\"displayTimeUnit\":\"ms\"}";
+  }
+
+ private:
+  std::atomic<uint64_t> head_ = 0;
+  Event events_[kSize];
+
+  static uint32_t ThreadId() noexcept {
+    static std::atomic<uint32_t> next = 0;
+    thread_local const uint32_t id = next.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+};
+
+// the ring is allocated at the first start and never freed while the library
+// is loaded, so that spans in flight can safely finish recording
+inline std::atomic<bool>  active_ = false;
+inline std::atomic<Ring*> ring_   = nullptr;
+#endif
+
+
+inline bool IsActive() noexcept {
+#if defined(PASSPAWN_TRACE)
+  return active_.load(std::memory_order_acquire);
+#else
+  return false;
+#endif
+}
+
+inline Stamp Now() noexcept {
+  if (!IsActive()) return 0;
+  const auto t = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+}
+
+inline void Record(const char* name, Stamp begin, Stamp end) noexcept {
+#if defined(PASSPAWN_TRACE)
+  if (begin == 0 || !IsActive()) return;
+  if (auto r = ring_.load(std::memory_order_acquire)) r->Record(name, begin, end);
+#else
+  (void) name, (void) begin, (void) end;
+#endif
+}
+
+
+struct Span final {
+ public:
+  Span(const char* name) noexcept : name_(name), begin_(Now()) {
+  }
+  ~Span() noexcept {
+    if (begin_ != 0) Record(name_, begin_, Now());
+  }
+  Span(const Span&) = delete;
+  Span(Span&&) = delete;
+  Span& operator=(const Span&) = delete;
+  Span& operator=(Span&&) = delete;
+
+ private:
+  const char* name_;
+  Stamp begin_;
+};
+
+
+// shared implementation of the trace node registered by each library
+using Inputs  = Sockets<"start", "stop", "dump">;
+using Outputs = Sockets<"out", "error">;
+
+inline void Handle(const nf7_node_msg_t* in) noexcept
+try {
+#if defined(PASSPAWN_TRACE)
+  Inputs::Dispatch(in->name, [&](In<"start">) {
+    static std::once_flag once;
+    std::call_once(once, []() {
+      ring_.store(new Ring, std::memory_order_release);
+    });
+    active_.store(true, std::memory_order_release);
+  }, [&](In<"stop">) {
+    active_.store(false, std::memory_order_relaxed);
+  }, [&](In<"dump">) {
+    const auto r = ring_.load(std::memory_order_acquire);
+    if (!r) throw std::runtime_error {"tracing has never been started"};
+    std::ostringstream st;
+    r->Dump(st);
+    pp::MutValue {in->value} = std::string_view {st.str()};
+    Emit<"out", Outputs>(in->ctx, in->value);
+  });
+#else
+  throw std::runtime_error {"tracing is disabled (build with PASSPAWN_TRACE)"};
+#endif
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  Emit<"error", Outputs>(in->ctx, in->value);
+}
+
+}  // namespace pp::trace
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstring>
+#include <optional>
 #include <span>
 #include <stdexcept>
 #include <string_view>
@@ -117,6 +118,12 @@ struct ConstValue {
     }
     throw std::runtime_error {"missing tuple field"};
   }
+  std::optional<ConstValue> find(const char* name) const noexcept {
+    if (auto ret = nf7->value.get_tuple(ptr_, name)) {
+      return ConstValue {ret};
+    }
+    return std::nullopt;
+  }
 
   uint8_t type() const noexcept { return nf7->value.get_type(ptr_); }
   const nf7_value_t* ptr() const noexcept { return ptr_; }
@@ -13,6 +13,8 @@ extern "C" void nf7_init(nf7_init_t* init) noexcept {
 
   REGISTER_(nfile_read);
   REGISTER_(nfile_write);
+  REGISTER_(record_split);
+  REGISTER_(io_trace);
 
 # undef REGISTER_
 }
@@ -1,49 +1,159 @@
+#include <atomic>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <variant>
 
+#if defined(__linux__)
+# include <cerrno>
+# include <thread>
+
+# include <poll.h>
+# include <sys/eventfd.h>
+# include <sys/inotify.h>
+# include <unistd.h>
+#endif
+
 #include "nf7.hh"
 
+#include "common/node.hh"
 #include "common/queue.hh"
+#include "common/trace.hh"
 #include "common/value.hh"
 
-using namespace std::literals;
-
 
 static void* init() noexcept;
 static void deinit(void*) noexcept;
 static void handle_read(const nf7_node_msg_t*) noexcept;
 static void handle_write(const nf7_node_msg_t*) noexcept;
 
-static const char* I_read[] = {"open", "read", "skip", "seek", "close", nullptr};
-static const char* O_read[] = {"data", "done", "error", nullptr};
+using I_read = pp::Sockets<"open", "read", "skip", "seek", "follow", "close", "abort">;
+using O_read = pp::Sockets<"data", "done", "error">;
 extern "C" const nf7_node_t nfile_read = {
   .name    = "nfile_read",
   .desc    = "reads data from a native file specified by path",
-  .inputs  = I_read,
-  .outputs = O_read,
+  .inputs  = I_read::kList,
+  .outputs = O_read::kList,
   .init    = init,
   .deinit  = deinit,
   .handle  = handle_read,
 };
 
-static const char* I_write[] = {"open", "write", "skip", "seek", "close", nullptr};
-static const char* O_write[] = {"done", "error", nullptr};
+using I_write = pp::Sockets<"open", "write", "skip", "seek", "close", "abort">;
+using O_write = pp::Sockets<"done", "error">;
 extern "C" const nf7_node_t nfile_write = {
   .name    = "nfile_write",
   .desc    = "writes data to a native file specified by path",
-  .inputs  = I_write,
-  .outputs = O_write,
+  .inputs  = I_write::kList,
+  .outputs = O_write::kList,
   .init    = init,
   .deinit  = deinit,
   .handle  = handle_write,
 };
 
 
+namespace {
+
+#if defined(__linux__)
+// watches a file and its directory by inotify on a background thread,
+// and calls a function on each change until destroyed
+struct Follower final {
+ public:
+  enum Event {
+    kModified,
+    kReplaced,  // another file is created at the path (e.g. log rotation)
+  };
+
+  Follower(const std::filesystem::path& npath, std::function<void(Event)>&& f) :
+      npath_(std::filesystem::absolute(npath)), f_(std::move(f)) {
+    ino_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    ev_  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ino_ >= 0 && ev_ >= 0) {
+      dir_  = inotify_add_watch(ino_, npath_.parent_path().c_str(), IN_CREATE | IN_MOVED_TO);
+      file_ = inotify_add_watch(ino_, npath_.c_str(), kFileMask);
+    }
+    if (dir_ < 0 || file_ < 0) {
+      Close();
+      throw std::runtime_error {"failed to watch the file"};
+    }
+    th_ = std::thread {[this]() { Main(); }};
+  }
+  ~Follower() noexcept {
+    const uint64_t one = 1;
+    (void) !write(ev_, &one, sizeof(one));
+    th_.join();
+    Close();
+  }
+  Follower(const Follower&) = delete;
+  Follower(Follower&&) = delete;
+  Follower& operator=(const Follower&) = delete;
+  Follower& operator=(Follower&&) = delete;
+
+ private:
+  static constexpr uint32_t kFileMask = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+
+  const std::filesystem::path npath_;
+  const std::function<void(Event)> f_;
+
+  int ino_  = -1;
+  int ev_   = -1;
+  int dir_  = -1;
+  int file_ = -1;
+
+  std::thread th_;
+
+
+  void Main() noexcept {
+    alignas(inotify_event) char buf[4096];
+    pollfd fds[2] = {
+      {.fd = ino_, .events = POLLIN, .revents = 0},
+      {.fd = ev_,  .events = POLLIN, .revents = 0},
+    };
+    const auto name = npath_.filename();
+    for (;;) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      if (fds[1].revents) return;
+
+      // events read at once are coalesced
+      bool modified = false, replaced = false;
+      for (ssize_t n; (n = read(ino_, buf, sizeof(buf))) > 0;) {
+        for (auto p = buf; p < buf+n;) {
+          const auto& e = *reinterpret_cast<const inotify_event*>(p);
+          if (e.wd == file_) {
+            modified = true;
+          } else if (e.wd == dir_ && e.len > 0 && name == e.name) {
+            replaced = true;
+          }
+          p += sizeof(inotify_event) + e.len;
+        }
+      }
+      if (replaced) {
+        inotify_rm_watch(ino_, file_);
+        file_ = inotify_add_watch(ino_, npath_.c_str(), kFileMask);
+        f_(kReplaced);
+      } else if (modified) {
+        f_(kModified);
+      }
+    }
+  }
+  void Close() noexcept {
+    if (ino_ >= 0) close(ino_);
+    if (ev_  >= 0) close(ev_);
+  }
+};
+#endif
+
 struct Context final {
  public:
+  // bytes read or written at once, between checks of an abort
+  static constexpr std::streamsize kPiece = 1024*1024;
+
   struct ReadOpen final {
     std::filesystem::path npath;
   };
@@ -57,6 +167,11 @@ struct Context final {
   struct ReadSeek final {
     std::ifstream::off_type n;
   };
+  struct ReadFollow final {
+    // the node's context, which outlives the follower
+    nf7_ctx_t* ctx;
+  };
+  struct ReadTail final { };
 
   struct WriteOpen final {
     std::filesystem::path npath;
@@ -73,35 +188,45 @@ struct Context final {
   };
 
   struct Close final { };
+  struct AbortClose final { };  // closes without 'done'
 
   using V = std::variant<
-      ReadOpen, ReadExec, ReadSkip, ReadSeek,
+      ReadOpen, ReadExec, ReadSkip, ReadSeek, ReadFollow, ReadTail,
       WriteOpen, WriteExec, WriteSkip, WriteSeek,
-      Close>;
+      Close, AbortClose>;
 
   void operator()(nf7_ctx_t* ctx, const V& v) noexcept
   try {
+    PP_TRACE_SPAN("nfile:handle");
     try {
       std::visit([&](auto& v) { Handle(ctx, v); }, v);
     } catch (std::bad_variant_access&) {
       throw std::runtime_error {"invalid state"};
     }
+    if (std::holds_alternative<ReadTail>(v) || std::holds_alternative<AbortClose>(v)) return;
     pp::MutValue {ctx->value} = pp::MutValue::Pulse {};
-    nf7->ctx.exec_emit(ctx, "done", ctx->value, 0);
+    pp::Emit<"done", O_read, O_write>(ctx, ctx->value);
+  } catch (pp::Aborted&) {
   } catch (std::exception& e) {
     pp::MutValue {ctx->value} = e.what();
-    nf7->ctx.exec_emit(ctx, "error", ctx->value, 0);
+    pp::Emit<"error", O_read, O_write>(ctx, ctx->value);
   }
   void Push(nf7_ctx_t* ctx, V&& v) noexcept {
     q_.PushAndVisit<Context>(ctx, std::move(v));
   }
+  // drops pending operations, stops the current one and closes the file
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, AbortClose {});
+  }
 
-  void Handle(nf7_ctx_t*, const ReadOpen& p) {
-    st_ = std::monostate {};
+  void Handle(nf7_ctx_t* ctx, const ReadOpen& p) {
+    Handle(ctx, Close {});
     st_ = std::ifstream {p.npath, std::ios::binary};
     if (!std::get<std::ifstream>(st_)) {
       throw std::runtime_error {"failed to open"};
     }
+    npath_ = p.npath;
   }
   void Handle(nf7_ctx_t* ctx, const ReadExec& p) {
     if (p.n == 0) return;
@@ -116,10 +241,14 @@ struct Context final {
     const auto n   = std::min(max, p.n > 0? p.n: max);
 
     auto ptr = nf7->value.set_vector(ctx->value, static_cast<size_t>(n));
-    st.read(reinterpret_cast<char*>(ptr), n);
-    if (!st) throw std::runtime_error {"failed to read"};
+    for (std::streamsize off = 0; off < n; off += kPiece) {
+      q_.token().ThrowIfAborted();
+      st.read(reinterpret_cast<char*>(ptr)+off, std::min(kPiece, n-off));
+      if (!st) throw std::runtime_error {"failed to read"};
+    }
 
-    nf7->ctx.exec_emit(ctx, "data", ctx->value, 0);
+    PP_TRACE_SPAN("nfile:emit");
+    pp::Emit<"data", O_read>(ctx, ctx->value);
   }
   void Handle(nf7_ctx_t*, const ReadSkip& p) {
     auto& st = std::get<std::ifstream>(st_);
@@ -131,9 +260,46 @@ struct Context final {
     st.seekg(p.n, std::ios_base::beg);
     if (!st) throw std::runtime_error {"failed to seek"};
   }
+  // reads to the end, and then emits bytes appended to the file as soon as
+  // inotify notices, until the file is closed
+  void Handle(nf7_ctx_t* ctx, const ReadFollow& p) {
+    if (!std::holds_alternative<std::ifstream>(st_)) {
+      throw std::runtime_error {"not opened for reading"};
+    }
+#if defined(__linux__)
+    // watches before reading so that no change is missed
+    follower_ = nullptr;
+    tail_.store(false);
+    rotated_.store(false);
+    follower_ = std::make_unique<Follower>(npath_, [this, nctx = p.ctx](auto e) {
+      if (e == Follower::kReplaced) rotated_.store(true);
+      if (!tail_.exchange(true)) Push(nctx, ReadTail {});
+    });
+    following_ = true;
+    Handle(ctx, ReadTail {});
+#else
+    (void) ctx;
+    (void) p;
+    throw std::runtime_error {"follow mode is not supported on this platform"};
+#endif
+  }
+  void Handle(nf7_ctx_t* ctx, const ReadTail&) {
+    // cleared before reading so that changes while reading are not missed
+    tail_.store(false);
+    if (!following_) return;
 
-  void Handle(nf7_ctx_t*, const WriteOpen& p) {
-    st_ = std::monostate {};
+    auto& st = std::get<std::ifstream>(st_);
+    ReadToEnd(ctx, st);
+    if (rotated_.exchange(false)) {
+      // the rest of the rotated file has been read above
+      st = std::ifstream {npath_, std::ios::binary};
+      if (!st) throw std::runtime_error {"failed to reopen the rotated file"};
+      ReadToEnd(ctx, st);
+    }
+  }
+
+  void Handle(nf7_ctx_t* ctx, const WriteOpen& p) {
+    Handle(ctx, Close {});
     st_ = std::ofstream {p.npath, std::ios::binary};
     if (!std::get<std::ofstream>(st_)) {
       throw std::runtime_error {"failed to open"};
@@ -146,8 +312,12 @@ struct Context final {
       st.seekp(*p.off, std::ios_base::beg);
       if (!st) throw std::runtime_error {"failed to seek before writing"};
     }
-    st.write(str.data(), static_cast<std::streamsize>(str.size()));
-    if (!st) throw std::runtime_error {"failed to write"};
+    const auto n = static_cast<std::streamsize>(str.size());
+    for (std::streamsize off = 0; off < n; off += kPiece) {
+      q_.token().ThrowIfAborted();
+      st.write(str.data()+off, std::min(kPiece, n-off));
+      if (!st) throw std::runtime_error {"failed to write"};
+    }
   }
   void Handle(nf7_ctx_t*, const WriteSkip& p) {
     auto& st = std::get<std::ofstream>(st_);
@@ -161,26 +331,73 @@ struct Context final {
   }
 
   void Handle(nf7_ctx_t*, const Close&) {
+#if defined(__linux__)
+    follower_ = nullptr;
+#endif
+    following_ = false;
     st_ = std::monostate {};
   }
+  void Handle(nf7_ctx_t* ctx, const AbortClose&) {
+    Handle(ctx, Close {});
+  }
 
  private:
-  pp::Queue<V> q_;
+  pp::Queue<V> q_ {"nfile:wait"};
 
   std::variant<std::monostate, std::ifstream, std::ofstream> st_;
+  std::filesystem::path npath_;
+
+  // set by the follower to request a ReadTail, which is pushed only once
+  // until it starts
+  std::atomic<bool> tail_    = false;
+  std::atomic<bool> rotated_ = false;
+  bool following_ = false;
+
+#if defined(__linux__)
+  // declared last to be stopped before the others are destroyed
+  std::unique_ptr<Follower> follower_;
+#endif
+
+
+  // reads all bytes from the current position to the end,
+  // or from the beginning when the file has been truncated
+  void ReadToEnd(nf7_ctx_t* ctx, std::ifstream& st) {
+    st.clear();
+    auto pos = st.tellg();
+    st.seekg(0, std::ios_base::end);
+    const auto end = st.tellg();
+    if (pos < 0 || end < 0) throw std::runtime_error {"failed to get the file size"};
+    if (end < pos) pos = 0;
+    st.seekg(pos);
+
+    for (auto n = end-pos; n > 0;) {
+      q_.token().ThrowIfAborted();
+      const auto size = std::min<std::streamoff>(n, kPiece);
+      auto ptr = nf7->value.set_vector(ctx->value, static_cast<size_t>(size));
+      st.read(reinterpret_cast<char*>(ptr), size);
+      if (!st) throw std::runtime_error {"failed to read"};
+      n -= size;
+
+      PP_TRACE_SPAN("nfile:emit");
+      pp::Emit<"data", O_read>(ctx, ctx->value);
+    }
+  }
 };
 
+}  // namespace
+
 static void* init() noexcept { return new Context; }
 static void deinit(void* ptr) noexcept { delete reinterpret_cast<Context*>(ptr); }
 
 static void handle_read(const nf7_node_msg_t* in) noexcept
 try {
+  PP_TRACE_SPAN("nfile_read:recv");
   auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
   auto  v   = pp::ConstValue {in->value};
-  if (in->name == "open"s) {
+  I_read::Dispatch(in->name, [&](pp::In<"open">) {
     // TODO: get Env::npath()
     ctx.Push(in->ctx, Context::ReadOpen {.npath = v.string()});
-  } else if (in->name == "read"s) {
+  }, [&](pp::In<"read">) {
     Context::ReadExec p;
     switch (v.type()) {
     case NF7_INTEGER:
@@ -197,25 +414,30 @@ try {
       throw std::runtime_error {"invalid input"};
     }
     ctx.Push(in->ctx, std::move(p));
-  } else if (in->name == "skip"s) {
+  }, [&](pp::In<"skip">) {
     ctx.Push(in->ctx, Context::ReadSkip {.n = v.integerOrScalar<std::ifstream::off_type>()});
-  } else if (in->name == "seek"s) {
+  }, [&](pp::In<"seek">) {
     ctx.Push(in->ctx, Context::ReadSeek {.n = v.integerOrScalar<std::ifstream::off_type>()});
-  } else if (in->name == "close"s) {
+  }, [&](pp::In<"follow">) {
+    ctx.Push(in->ctx, Context::ReadFollow {.ctx = in->ctx});
+  }, [&](pp::In<"close">) {
     ctx.Push(in->ctx, Context::Close {});
-  }
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  });
 } catch (std::exception& e) {
   pp::MutValue {in->value} = e.what();
-  nf7->ctx.exec_emit(in->ctx, "error", in->value, 0);
+  pp::Emit<"error", O_read>(in->ctx, in->value);
 }
 static void handle_write(const nf7_node_msg_t* in) noexcept
 try {
+  PP_TRACE_SPAN("nfile_write:recv");
   auto  v   = pp::ConstValue {in->value};
   auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
-  if (in->name == "open"s) {
+  I_write::Dispatch(in->name, [&](pp::In<"open">) {
     // TODO: get Env::npath()
     ctx.Push(in->ctx, Context::WriteOpen {.npath = v.string()});
-  } else if (in->name == "write"s) {
+  }, [&](pp::In<"write">) {
     std::optional<Context::WriteExec> p;
     switch (v.type()) {
     case NF7_VECTOR:
@@ -232,14 +454,16 @@ try {
       throw std::runtime_error {"invalid input"};
     }
     ctx.Push(in->ctx, std::move(*p));
-  } else if (in->name == "skip"s) {
+  }, [&](pp::In<"skip">) {
     ctx.Push(in->ctx, Context::WriteSkip {.n = v.integerOrScalar<std::ifstream::off_type>()});
-  } else if (in->name == "seek"s) {
+  }, [&](pp::In<"seek">) {
     ctx.Push(in->ctx, Context::WriteSeek {.n = v.integerOrScalar<std::ifstream::off_type>()});
-  } else if (in->name == "close"s) {
+  }, [&](pp::In<"close">) {
     ctx.Push(in->ctx, Context::Close {});
-  }
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  });
 } catch (std::exception& e) {
   pp::MutValue {in->value} = e.what();
-  nf7->ctx.exec_emit(in->ctx, "error", in->value, 0);
+  pp::Emit<"error", O_write>(in->ctx, in->value);
 }
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "nf7.hh"
+
+#include "common/node.hh"
+#include "common/queue.hh"
+#include "common/trace.hh"
+#include "common/value.hh"
+
+
+static void* init() noexcept;
+static void deinit(void*) noexcept;
+static void handle(const nf7_node_msg_t*) noexcept;
+
+using I = pp::Sockets<"init", "in", "end", "abort">;
+using O = pp::Sockets<"out", "error">;
+extern "C" const nf7_node_t record_split = {
+  .name    = "record_split",
+  .desc    = "splits a chunked byte stream into records by a delimiter or a length prefix",
+  .inputs  = I::kList,
+  .outputs = O::kList,
+  .init    = init,
+  .deinit  = deinit,
+  .handle  = handle,
+};
+
+
+namespace {
+
+struct Config final {
+  // delimiter mode if not empty
+  std::string delim = "\n";
+
+  // length prefix mode, bytes of an unsigned integer preceding each record
+  size_t prefix    = 0;
+  bool   bigendian = true;
+
+  // Emits all complete records in a chunk at once instead of each record.
+  // A batch keeps the framing of the input, that is, each record is followed
+  // by its delimiter or preceded by its prefix, so a consumer parsing the
+  // framing by itself gets many records per message without copies. A batch
+  // never ends in the middle of a record, but the last record flushed by
+  // 'end' in delimiter mode has no delimiter.
+  bool batch = false;
+
+  // the longest record in bytes, which bounds the partial record kept
+  // while no delimiter arrives
+  size_t max = 64*1024*1024;
+};
+
+struct Context final {
+ public:
+  struct Init final {
+    Config conf;
+  };
+  struct Exec final {
+    pp::UniqValue v;
+  };
+  struct End final { };
+  struct Reset final { };
+  using V = std::variant<Init, Exec, End, Reset>;
+
+  void operator()(nf7_ctx_t* ctx, const V& v) noexcept
+  try {
+    PP_TRACE_SPAN("record_split:handle");
+    std::visit([&](auto& v) { Handle(ctx, v); }, v);
+  } catch (pp::Aborted&) {
+  } catch (std::exception& e) {
+    // the broken record is dropped, so the following chunks don't fail by it
+    carry_.clear();
+    pp::MutValue {ctx->value} = e.what();
+    pp::Emit<"error", O>(ctx, ctx->value);
+  }
+  void Push(nf7_ctx_t* ctx, V&& v) noexcept {
+    q_.PushAndVisit<Context>(ctx, std::move(v));
+  }
+  // drops pending chunks and the partial record
+  void Abort(nf7_ctx_t* ctx) noexcept {
+    q_.Abort();
+    Push(ctx, Reset {});
+  }
+
+  void Handle(nf7_ctx_t*, const Init& p) {
+    conf_ = p.conf;
+    carry_.clear();
+  }
+  void Handle(nf7_ctx_t* ctx, const Exec& p) {
+    const auto buf = p.v.vectorOrString();
+    if (conf_.prefix > 0) {
+      SplitByPrefix(ctx, buf);
+    } else if (conf_.batch) {
+      SplitByDelimiterInBatch(ctx, buf);
+    } else {
+      SplitByDelimiter(ctx, buf);
+    }
+  }
+  void Handle(nf7_ctx_t* ctx, const End&) {
+    if (carry_.empty()) return;
+    if (conf_.prefix > 0) {
+      throw std::runtime_error {"stream ended in the middle of a record"};
+    }
+    Emit(ctx, {});
+  }
+  void Handle(nf7_ctx_t*, const Reset&) {
+    carry_.clear();
+  }
+
+ private:
+  pp::Queue<V> q_ {"record_split:wait"};
+
+  Config conf_;
+
+  // a partial record left by the previous chunk
+  std::vector<uint8_t> carry_;
+
+
+  // emits carry_ and buf as one record and clears carry_
+  void Emit(nf7_ctx_t* ctx, std::span<const uint8_t> buf) {
+    q_.token().ThrowIfAborted();
+    if (!conf_.batch && carry_.size()+buf.size() > conf_.max) {
+      throw std::runtime_error {"too long record"};
+    }
+
+    PP_TRACE_SPAN("record_split:emit");
+    auto dst = nf7->value.set_vector(ctx->value, carry_.size()+buf.size());
+    if (carry_.size()) std::memcpy(dst, carry_.data(), carry_.size());
+    if (buf.size())    std::memcpy(dst+carry_.size(), buf.data(), buf.size());
+    carry_.clear();
+    pp::Emit<"out", O>(ctx, ctx->value);
+  }
+  void Carry(std::span<const uint8_t> buf) {
+    // a partial record can end with a part of the delimiter
+    const auto n = carry_.size()+buf.size();
+    if (conf_.prefix == 0 && n > conf_.max && n-conf_.max >= conf_.delim.size()) {
+      throw std::runtime_error {"too long record"};
+    }
+    carry_.insert(carry_.end(), buf.begin(), buf.end());
+  }
+
+  // finds a delimiter, which begins in carry_ and ends in buf,
+  // and returns the bytes of it in buf
+  size_t FindStraddle(std::span<const uint8_t> buf) const noexcept {
+    const auto& d = conf_.delim;
+    for (size_t k = std::min(d.size()-1, carry_.size()); k > 0; --k) {
+      const auto rest = d.size()-k;
+      if (rest <= buf.size() &&
+          std::memcmp(carry_.data()+carry_.size()-k, d.data(), k) == 0 &&
+          std::memcmp(buf.data(), d.data()+k, rest) == 0) {
+        return rest;
+      }
+    }
+    return 0;
+  }
+
+  // memchr/memrchr are vectorized by libc with a runtime CPU dispatch
+  std::optional<size_t> Find(std::span<const uint8_t> buf) const noexcept {
+    const auto& d = conf_.delim;
+    for (auto p = buf.data(), end = buf.data()+buf.size(); p < end;) {
+      p = reinterpret_cast<const uint8_t*>(
+          std::memchr(p, d[0], static_cast<size_t>(end-p)));
+      if (!p) break;
+      if (static_cast<size_t>(end-p) >= d.size() &&
+          std::memcmp(p, d.data(), d.size()) == 0) {
+        return static_cast<size_t>(p-buf.data());
+      }
+      ++p;
+    }
+    return std::nullopt;
+  }
+  std::optional<size_t> FindLast(std::span<const uint8_t> buf) const noexcept {
+    const auto& d = conf_.delim;
+    if (d.size() > buf.size()) return std::nullopt;
+#if defined(__GLIBC__)
+    auto n = buf.size()-d.size()+1;
+    while (n > 0) {
+      auto p = reinterpret_cast<const uint8_t*>(memrchr(buf.data(), d[0], n));
+      if (!p) break;
+      if (std::memcmp(p, d.data(), d.size()) == 0) {
+        return static_cast<size_t>(p-buf.data());
+      }
+      n = static_cast<size_t>(p-buf.data());
+    }
+#else
+    const auto itr = std::search(buf.rbegin(), buf.rend(), d.rbegin(), d.rend());
+    if (itr != buf.rend()) {
+      return static_cast<size_t>(buf.rend()-itr)-d.size();
+    }
+#endif
+    return std::nullopt;
+  }
+
+  void SplitByDelimiter(nf7_ctx_t* ctx, std::span<const uint8_t> buf) {
+    const auto dn = conf_.delim.size();
+    if (const auto n = FindStraddle(buf)) {
+      carry_.resize(carry_.size()-(dn-n));
+      Emit(ctx, {});
+      buf = buf.subspan(n);
+    }
+    while (const auto pos = Find(buf)) {
+      Emit(ctx, buf.first(*pos));
+      buf = buf.subspan(*pos+dn);
+    }
+    Carry(buf);
+  }
+  void SplitByDelimiterInBatch(nf7_ctx_t* ctx, std::span<const uint8_t> buf) {
+    const auto dn = conf_.delim.size();
+    if (const auto pos = FindLast(buf)) {
+      Emit(ctx, buf.first(*pos+dn));
+      buf = buf.subspan(*pos+dn);
+    } else if (const auto n = FindStraddle(buf)) {
+      Emit(ctx, buf.first(n));
+      buf = buf.subspan(n);
+    }
+    Carry(buf);
+  }
+
+  void SplitByPrefix(nf7_ctx_t* ctx, std::span<const uint8_t> buf) {
+    const auto pn = conf_.prefix;
+
+    // completes the record carried from the previous chunk
+    if (carry_.size()) {
+      if (carry_.size() < pn) {
+        const auto n = std::min(pn-carry_.size(), buf.size());
+        Carry(buf.first(n));
+        buf = buf.subspan(n);
+        if (carry_.size() < pn) return;
+      }
+      const auto want = pn + ReadLength(carry_.data()) - carry_.size();
+      if (buf.size() < want) {
+        Carry(buf);
+        return;
+      }
+      if (conf_.batch) {
+        Carry(buf.first(want));
+        Emit(ctx, {});
+      } else {
+        carry_.erase(carry_.begin(), carry_.begin()+static_cast<ptrdiff_t>(pn));
+        Emit(ctx, buf.first(want));
+      }
+      buf = buf.subspan(want);
+    }
+
+    // emits complete records directly from the chunk
+    size_t batched = 0;
+    for (;;) {
+      const auto rest = buf.subspan(batched);
+      if (rest.size() < pn) break;
+      const auto len = ReadLength(rest.data());
+      if (rest.size()-pn < len) break;
+
+      if (conf_.batch) {
+        batched += pn+len;
+      } else {
+        Emit(ctx, rest.subspan(pn, len));
+        buf = rest.subspan(pn+len);
+      }
+    }
+    if (batched > 0) {
+      Emit(ctx, buf.first(batched));
+      buf = buf.subspan(batched);
+    }
+    Carry(buf);
+  }
+  size_t ReadLength(const uint8_t* p) const {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < conf_.prefix; ++i) {
+      const auto b = conf_.bigendian? p[i]: p[conf_.prefix-1-i];
+      ret = (ret << 8) | b;
+    }
+    if (ret > conf_.max) throw std::runtime_error {"too long record"};
+    return static_cast<size_t>(ret);
+  }
+};
+
+}  // namespace
+
+
+static void* init() noexcept {
+  return new Context;
+}
+static void deinit(void* ptr) noexcept {
+  delete reinterpret_cast<Context*>(ptr);
+}
+
+static void handle(const nf7_node_msg_t* in) noexcept
+try {
+  PP_TRACE_SPAN("record_split:recv");
+  auto  v   = pp::ConstValue {in->value};
+  auto& ctx = *reinterpret_cast<Context*>(in->ctx->ptr);
+  I::Dispatch(in->name, [&](pp::In<"init">) {
+    Config conf;
+    switch (v.type()) {
+    case NF7_STRING:
+      conf.delim = v.string();
+      break;
+    case NF7_TUPLE:
+      if (auto d = v.find("delim")) {
+        conf.delim = d->stringOrVector();
+      }
+      if (auto p = v.find("prefix")) {
+        conf.prefix = p->integerOrScalar<size_t>();
+        conf.delim.clear();
+      }
+      if (auto e = v.find("endian")) {
+        const auto str = e->string();
+        if (str != "big" && str != "little") {
+          throw std::runtime_error {"endian must be 'big' or 'little'"};
+        }
+        conf.bigendian = str == "big";
+      }
+      if (auto b = v.find("batch")) {
+        conf.batch = b->integerOrScalar<int>() != 0;
+      }
+      if (auto m = v.find("max")) {
+        conf.max = m->integerOrScalar<size_t>();
+      }
+      break;
+    default:
+      throw std::runtime_error {"invalid input"};
+    }
+    if (conf.prefix == 0 && conf.delim.empty()) {
+      throw std::runtime_error {"delimiter is empty"};
+    }
+    if (conf.prefix > 8) {
+      throw std::runtime_error {"prefix is out of range (1~8)"};
+    }
+    if (conf.max == 0) {
+      throw std::runtime_error {"max must be positive"};
+    }
+    ctx.Push(in->ctx, Context::Init {.conf = std::move(conf)});
+  }, [&](pp::In<"in">) {
+    ctx.Push(in->ctx, Context::Exec {.v = v});
+  }, [&](pp::In<"end">) {
+    ctx.Push(in->ctx, Context::End {});
+  }, [&](pp::In<"abort">) {
+    ctx.Abort(in->ctx);
+  });
+} catch (std::exception& e) {
+  pp::MutValue {in->value} = e.what();
+  pp::Emit<"error", O>(in->ctx, in->value);
+}
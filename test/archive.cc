@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__linux__)
+# include <sys/resource.h>
+#endif
+
+#include <zlib-ng.h>
+
+#include "test/harness.hh"
+
+using namespace pp::test;
+
+extern "C" const nf7_node_t archive_read;
+
+
+static void LE(std::string& dst, uint64_t v, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dst += static_cast<char>((v >> (i*8)) & 0xFF);
+  }
+}
+static uint32_t CRC(std::string_view data) noexcept {
+  return static_cast<uint32_t>(zng_crc32(
+      0, reinterpret_cast<const uint8_t*>(data.data()), static_cast<uint32_t>(data.size())));
+}
+
+// compresses data into a raw deflate stream (wbits < 0) or a gzip member (wbits > 15)
+static std::string Deflate(std::string_view data, int wbits) {
+  zng_stream zs = {};
+  zng_deflateInit2(&zs, 6, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
+
+  std::string ret(zng_deflateBound(&zs, static_cast<unsigned long>(data.size())), '\0');
+  zs.next_in   = reinterpret_cast<const uint8_t*>(data.data());
+  zs.avail_in  = static_cast<uint32_t>(data.size());
+  zs.next_out  = reinterpret_cast<uint8_t*>(ret.data());
+  zs.avail_out = static_cast<uint32_t>(ret.size());
+  zng_deflate(&zs, Z_FINISH);
+  ret.resize(ret.size()-zs.avail_out);
+  zng_deflateEnd(&zs);
+  return ret;
+}
+
+// compresses head, n zero bytes and tail into a gzip member,
+// without holding the zeros in memory
+static std::string DeflateZeros(std::string_view head, uint64_t n, std::string_view tail) {
+  zng_stream zs = {};
+  zng_deflateInit2(&zs, 1, Z_DEFLATED, MAX_WBITS+16, 8, Z_DEFAULT_STRATEGY);
+
+  std::string ret;
+  const std::string zeros(1024*1024, '\0');
+  const auto feed = [&](std::string_view in, int flush) {
+    zs.next_in  = reinterpret_cast<const uint8_t*>(in.data());
+    zs.avail_in = static_cast<uint32_t>(in.size());
+    uint8_t buf[64*1024];
+    do {
+      zs.next_out  = buf;
+      zs.avail_out = sizeof(buf);
+      zng_deflate(&zs, flush);
+      ret.append(reinterpret_cast<const char*>(buf), sizeof(buf)-zs.avail_out);
+    } while (zs.avail_out == 0);
+  };
+  feed(head, Z_NO_FLUSH);
+  for (; n > 0; n -= std::min<uint64_t>(n, zeros.size())) {
+    feed(std::string_view {zeros}.substr(0, static_cast<size_t>(std::min<uint64_t>(n, zeros.size()))),
+         Z_NO_FLUSH);
+  }
+  feed(tail, Z_FINISH);
+  zng_deflateEnd(&zs);
+  return ret;
+}
+
+// bytes which deflate cannot shrink much
+static std::string Noise(size_t n, uint32_t seed) {
+  std::string ret(n, '\0');
+  for (auto& c : ret) {
+    seed = seed*1103515245u + 12345u;
+    c    = static_cast<char>(seed >> 24);
+  }
+  return ret;
+}
+
+
+// ---- tar ----
+enum class Magic { kPosix, kOldGnu, };
+
+static std::string TarHeader(std::string_view name, uint64_t size, char type,
+                             Magic magic = Magic::kPosix, std::string_view prefix = "") {
+  std::string h(512, '\0');
+  name.copy(h.data(), 100);
+  std::snprintf(h.data()+100, 8,  "%07o", 0644);
+  std::snprintf(h.data()+124, 12, "%011llo", static_cast<unsigned long long>(size));
+  h[156] = type;
+  if (magic == Magic::kPosix) {
+    std::memcpy(h.data()+257, "ustar\0" "00", 8);
+    prefix.copy(h.data()+345, 155);
+  } else {
+    // old GNU tar keeps atime and ctime where POSIX has the prefix
+    std::memcpy(h.data()+257, "ustar  \0", 8);
+    std::memcpy(h.data()+345, "14735051622\0" "14735051622", 24);
+  }
+
+  std::memset(h.data()+148, ' ', 8);
+  unsigned sum = 0;
+  for (auto c : h) sum += static_cast<uint8_t>(c);
+  std::snprintf(h.data()+148, 8, "%06o", sum);
+  return h;
+}
+static std::string TarEntry(std::string_view name, std::string_view data,
+                            Magic magic = Magic::kPosix, std::string_view prefix = "") {
+  auto ret = TarHeader(name, data.size(), '0', magic, prefix);
+  ret += data;
+  ret.resize((ret.size()+511)/512*512, '\0');
+  return ret;
+}
+static std::string PaxEntry(std::string_view path) {
+  auto rec = " path=" + std::string {path} + "\n";
+  auto len = rec.size()+2;
+  if (std::to_string(len).size() > 2) ++len;
+  rec = std::to_string(len) + rec;
+
+  auto ret = TarHeader("PaxHeader", rec.size(), 'x');
+  ret += rec;
+  ret.resize((ret.size()+511)/512*512, '\0');
+  return ret;
+}
+static std::string TarEnd() {
+  return std::string(1024, '\0');
+}
+
+
+// ---- zip ----
+struct ZipEntry final {
+  std::string name;
+  std::string data;
+  bool deflate = false;
+  bool zip64   = false;
+
+  // overrides the uncompressed size written in the central directory
+  uint64_t usize = UINT64_MAX;
+};
+
+static std::string Zip(const std::vector<ZipEntry>& entries, bool zip64_end = false) {
+  std::string body, cd;
+  for (const auto& e : entries) {
+    const auto comp   = e.deflate? Deflate(e.data, -MAX_WBITS): e.data;
+    const auto usize  = e.usize != UINT64_MAX? e.usize: e.data.size();
+    const auto offset = body.size();
+
+    LE(body, 0x04034b50, 4);
+    LE(body, 20, 2);
+    LE(body, 0, 2);
+    LE(body, e.deflate? 8: 0, 2);
+    LE(body, 0, 4);
+    LE(body, CRC(e.data), 4);
+    LE(body, comp.size(), 4);
+    LE(body, e.data.size(), 4);
+    LE(body, e.name.size(), 2);
+    LE(body, 0, 2);
+    body += e.name;
+    body += comp;
+
+    LE(cd, 0x02014b50, 4);
+    LE(cd, 45, 2);
+    LE(cd, 45, 2);
+    LE(cd, 0, 2);
+    LE(cd, e.deflate? 8: 0, 2);
+    LE(cd, 0, 4);
+    LE(cd, CRC(e.data), 4);
+    LE(cd, e.zip64? 0xFFFFFFFF: comp.size(), 4);
+    LE(cd, e.zip64? 0xFFFFFFFF: usize, 4);
+    LE(cd, e.name.size(), 2);
+    LE(cd, e.zip64? 28: 0, 2);
+    LE(cd, 0, 2);
+    LE(cd, 0, 2);
+    LE(cd, 0, 2);
+    LE(cd, 0, 4);
+    LE(cd, e.zip64? 0xFFFFFFFF: offset, 4);
+    cd += e.name;
+    if (e.zip64) {
+      LE(cd, 0x0001, 2);
+      LE(cd, 24, 2);
+      LE(cd, usize, 8);
+      LE(cd, comp.size(), 8);
+      LE(cd, offset, 8);
+    }
+  }
+
+  std::string ret = body + cd;
+  if (zip64_end) {
+    const auto rec = ret.size();
+    LE(ret, 0x06064b50, 4);
+    LE(ret, 44, 8);
+    LE(ret, 45, 2);
+    LE(ret, 45, 2);
+    LE(ret, 0, 4);
+    LE(ret, 0, 4);
+    LE(ret, entries.size(), 8);
+    LE(ret, entries.size(), 8);
+    LE(ret, cd.size(), 8);
+    LE(ret, body.size(), 8);
+
+    LE(ret, 0x07064b50, 4);
+    LE(ret, 0, 4);
+    LE(ret, rec, 8);
+    LE(ret, 1, 4);
+  }
+  LE(ret, 0x06054b50, 4);
+  LE(ret, 0, 2);
+  LE(ret, 0, 2);
+  LE(ret, zip64_end? 0xFFFF: entries.size(), 2);
+  LE(ret, zip64_end? 0xFFFF: entries.size(), 2);
+  LE(ret, zip64_end? 0xFFFFFFFF: cd.size(), 4);
+  LE(ret, zip64_end? 0xFFFFFFFF: body.size(), 4);
+  LE(ret, 0, 2);
+  return ret;
+}
+
+
+// opens the archive, and returns the index and emissions of getting each name
+static std::vector<Emitted> Extract(nf7_value_t open, const std::vector<std::string>& names,
+                                    std::string* index = nullptr) {
+  Node n {archive_read};
+  n.Send("open", std::move(open));
+  auto es = n.Run();
+  if (index) *index = Collect(es, "index");
+  for (const auto& name : names) {
+    n.Send("get", String(name));
+  }
+  auto ret = n.Run();
+  ret.insert(ret.begin(), es.begin(), es.end());
+  return ret;
+}
+static std::string Member(const std::vector<Emitted>& es, std::string_view name) {
+  for (const auto& e : es) {
+    if (e.name == "member" && Bytes(Field(e.value, "name")) == name) {
+      return Bytes(Field(e.value, "buf"));
+    }
+  }
+  return "(missing)";
+}
+
+
+static void TestTar() {
+  const auto big = Noise(3*1024*1024, 1);
+  const auto tar =
+      TarEntry("a.txt", "hello", Magic::kPosix, "dir") +
+      TarEntry("b.txt", "old gnu", Magic::kOldGnu) +
+      PaxEntry("a/very/long/name/given/by/pax.txt") +
+      TarEntry("ignored", "pax") +
+      TarEntry("big.bin", big) +
+      TarEntry("c.txt", "tail") +
+      TarEnd();
+  const std::vector<std::string> names = {
+    "dir/a.txt", "b.txt", "a/very/long/name/given/by/pax.txt", "big.bin", "c.txt",
+  };
+
+  const auto check = [&](std::string_view file, std::string_view data) {
+    TempFile f {file, data};
+    std::string index;
+    const auto es = Extract(String(f.path()), names, &index);
+    PP_TEST_CHECK(index == "dir/a.txt\nb.txt\na/very/long/name/given/by/pax.txt\nbig.bin\nc.txt\n");
+    PP_TEST_CHECK(Count(es, "error") == 0);
+    PP_TEST_CHECK(Member(es, "dir/a.txt") == "hello");
+    PP_TEST_CHECK(Member(es, "b.txt") == "old gnu");
+    PP_TEST_CHECK(Member(es, "a/very/long/name/given/by/pax.txt") == "pax");
+    PP_TEST_CHECK(Member(es, "big.bin") == big);
+    PP_TEST_CHECK(Member(es, "c.txt") == "tail");
+  };
+  check("a.tar", tar);
+  check("a.tar.gz", Deflate(tar, MAX_WBITS+16));
+
+  // concatenated gzip members split in the middle of entries
+  const std::string_view v = tar;
+  const auto a = v.size()/3, b = v.size()*2/3 + 100;
+  check("b.tar.gz",
+        Deflate(v.substr(0, 700), MAX_WBITS+16) +
+        Deflate(v.substr(700, a-700), MAX_WBITS+16) +
+        Deflate(v.substr(a, b-a), MAX_WBITS+16) +
+        Deflate(v.substr(b), MAX_WBITS+16));
+
+  // a huge pax header is skipped without being buffered
+  {
+    const uint64_t size = 400*1024*1024;
+    TempFile f {"d.tar.gz", DeflateZeros(
+        TarHeader("PaxHeader", size, 'x'), size, TarEntry("after.txt", "after") + TarEnd())};
+    std::string index;
+    const auto es = Extract(String(f.path()), {"after.txt"}, &index);
+    PP_TEST_CHECK(index == "after.txt\n");
+    PP_TEST_CHECK(Member(es, "after.txt") == "after");
+#if defined(__linux__)
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    PP_TEST_CHECK(ru.ru_maxrss < 256*1024);
+#endif
+  }
+
+  // a declared size beyond the end of the archive
+  TempFile f {"c.tar", TarHeader("lie", 1024*1024, '0') + TarEnd()};
+  PP_TEST_CHECK(HasError(Extract(String(f.path()), {"lie"}), "broken member size"));
+}
+
+static void TestZip() {
+  const auto text = std::string(100000, 'x') + "end";
+  const std::vector<ZipEntry> entries = {
+    {.name = "stored.txt",   .data = "stored"},
+    {.name = "deflated.txt", .data = text, .deflate = true},
+    {.name = "zip64.bin",    .data = Noise(5000, 2), .deflate = true, .zip64 = true},
+    {.name = "dir/", .data = ""},
+  };
+  for (const bool zip64_end : {false, true}) {
+    TempFile f {zip64_end? "b.zip": "a.zip", Zip(entries, zip64_end)};
+    std::string index;
+    const auto es = Extract(String(f.path()), {"stored.txt", "deflated.txt", "zip64.bin"}, &index);
+    PP_TEST_CHECK(index == "stored.txt\ndeflated.txt\nzip64.bin\n");
+    PP_TEST_CHECK(Count(es, "error") == 0);
+    PP_TEST_CHECK(Member(es, "stored.txt") == "stored");
+    PP_TEST_CHECK(Member(es, "deflated.txt") == text);
+    PP_TEST_CHECK(Member(es, "zip64.bin") == entries[2].data);
+  }
+
+  // sizes are checked before allocation
+  TempFile f {"c.zip", Zip({
+    {.name = "bomb",   .data = "tiny", .deflate = true, .usize = 100*1024*1024},
+    {.name = "stored", .data = "12345"},
+  })};
+  PP_TEST_CHECK(HasError(Extract(String(f.path()), {"bomb"}), "broken member size"));
+  PP_TEST_CHECK(HasError(
+      Extract(Tuple({{"npath", String(f.path())}, {"max", Integer(4)}}), {"stored"}),
+      "too large member"));
+  PP_TEST_CHECK(Member(
+      Extract(Tuple({{"npath", String(f.path())}, {"max", Integer(5)}}), {"stored"}),
+      "stored") == "12345");
+}
+
+
+int main() {
+  TestTar();
+  TestZip();
+  return Result();
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "nf7.hh"
+
+
+// Values are owned by nf7 and opaque to nodes,
+// so the self-checks define their own in-memory representation.
+struct nf7_value_t final {
+  uint8_t type = NF7_PULSE;
+
+  bool    b = false;
+  int64_t i = 0;
+  double  f = 0;
+
+  std::string          str;
+  std::vector<uint8_t> vec;
+  std::vector<std::pair<std::string, std::shared_ptr<nf7_value_t>>> tup;
+};
+
+
+namespace pp::test {
+
+struct Emitted final {
+  std::string name;
+  nf7_value_t value;
+};
+
+// tasks requested by exec_async and values passed to exec_emit,
+// processed and collected on the calling thread by Node::Run()
+inline std::deque<std::function<void()>> tasks_;
+inline std::vector<Emitted> emitted_;
+
+inline const nf7_vtable_t kVTable = {
+  .init = {
+    .register_node = [](nf7_init_t*, const nf7_node_t*) { },
+  },
+  .ctx = {
+    .exec_async = [](nf7_ctx_t* ctx, void* ptr, void (*f)(nf7_ctx_t*, void*), uint64_t) {
+      tasks_.push_back([c = *ctx, ptr, f]() mutable {
+        nf7_value_t v;
+        c.value = &v;
+        f(&c, ptr);
+      });
+    },
+    .exec_emit = [](nf7_ctx_t*, const char* name, const nf7_value_t* v, uint64_t) {
+      emitted_.push_back({.name = name, .value = *v});
+    },
+  },
+  .value = {
+    .create = [](const nf7_value_t* v) {
+      return v? new nf7_value_t {*v}: new nf7_value_t;
+    },
+    .destroy = [](nf7_value_t* v) { delete v; },
+    .get_type = [](const nf7_value_t* v) { return v->type; },
+    .get_integer = [](const nf7_value_t* v, int64_t* i) {
+      if (v->type != NF7_INTEGER) return false;
+      *i = v->i;
+      return true;
+    },
+    .get_scalar = [](const nf7_value_t* v, double* f) {
+      if (v->type != NF7_SCALAR) return false;
+      *f = v->f;
+      return true;
+    },
+    .get_string = [](const nf7_value_t* v, size_t* n) -> const char* {
+      if (v->type != NF7_STRING) return nullptr;
+      if (n) *n = v->str.size();
+      return v->str.c_str();
+    },
+    .get_vector = [](const nf7_value_t* v, size_t* n) -> const uint8_t* {
+      static const uint8_t kEmpty = 0;
+      if (v->type != NF7_VECTOR) return nullptr;
+      if (n) *n = v->vec.size();
+      return v->vec.empty()? &kEmpty: v->vec.data();
+    },
+    .get_tuple = [](const nf7_value_t* v, const char* name) -> const nf7_value_t* {
+      if (v->type != NF7_TUPLE) return nullptr;
+      for (const auto& [k, x] : v->tup) {
+        if (k == name) return x.get();
+      }
+      return nullptr;
+    },
+    .set_pulse = [](nf7_value_t* v) { *v = {}; },
+    .set_boolean = [](nf7_value_t* v, bool b) {
+      *v = {};
+      v->type = NF7_BOOLEAN;
+      v->b    = b;
+    },
+    .set_integer = [](nf7_value_t* v, int64_t i) {
+      *v = {};
+      v->type = NF7_INTEGER;
+      v->i    = i;
+    },
+    .set_scalar = [](nf7_value_t* v, double f) {
+      *v = {};
+      v->type = NF7_SCALAR;
+      v->f    = f;
+    },
+    .set_string = [](nf7_value_t* v, size_t n) {
+      *v = {};
+      v->type = NF7_STRING;
+      v->str.resize(n);
+      return v->str.data();
+    },
+    .set_vector = [](nf7_value_t* v, size_t n) {
+      *v = {};
+      v->type = NF7_VECTOR;
+      v->vec.resize(n);
+      return v->vec.data();
+    },
+    .set_tuple = [](nf7_value_t* v, const char** names, nf7_value_t** ret) {
+      *v = {};
+      v->type = NF7_TUPLE;
+      for (size_t i = 0; names[i]; ++i) {
+        v->tup.emplace_back(names[i], std::make_shared<nf7_value_t>());
+        ret[i] = v->tup.back().second.get();
+      }
+    },
+  },
+};
+
+
+// an instance of a node, which processes its async tasks synchronously
+struct Node final {
+ public:
+  Node(const nf7_node_t& node) noexcept : node_(node) {
+    ctx_.ptr = node_.init();
+  }
+  ~Node() noexcept {
+    Run();
+    node_.deinit(ctx_.ptr);
+  }
+  Node(const Node&) = delete;
+  Node(Node&&) = delete;
+  Node& operator=(const Node&) = delete;
+  Node& operator=(Node&&) = delete;
+
+  Node& Send(const char* name, nf7_value_t v) noexcept {
+    ctx_.value = &v;
+    const nf7_node_msg_t msg = {.name = name, .value = &v, .ctx = &ctx_};
+    node_.handle(&msg);
+    ctx_.value = nullptr;
+    return *this;
+  }
+
+  // runs all pending tasks, and returns values emitted since the last call
+  std::vector<Emitted> Run() {
+    while (tasks_.size()) {
+      auto f = std::move(tasks_.front());
+      tasks_.pop_front();
+      f();
+    }
+    return std::exchange(emitted_, {});
+  }
+
+ private:
+  const nf7_node_t& node_;
+  nf7_ctx_t ctx_ = {};
+};
+
+
+inline nf7_value_t Pulse() noexcept {
+  return {};
+}
+inline nf7_value_t Integer(int64_t i) noexcept {
+  nf7_value_t ret;
+  kVTable.value.set_integer(&ret, i);
+  return ret;
+}
+inline nf7_value_t String(std::string_view s) {
+  nf7_value_t ret;
+  s.copy(kVTable.value.set_string(&ret, s.size()), s.size());
+  return ret;
+}
+inline nf7_value_t Vector(std::string_view s) {
+  nf7_value_t ret;
+  s.copy(reinterpret_cast<char*>(kVTable.value.set_vector(&ret, s.size())), s.size());
+  return ret;
+}
+inline nf7_value_t Tuple(std::vector<std::pair<std::string, nf7_value_t>> fields) {
+  nf7_value_t ret;
+  ret.type = NF7_TUPLE;
+  for (auto& [k, v] : fields) {
+    ret.tup.emplace_back(std::move(k), std::make_shared<nf7_value_t>(std::move(v)));
+  }
+  return ret;
+}
+
+// bytes of a string or vector
+inline std::string Bytes(const nf7_value_t& v) {
+  return v.type == NF7_VECTOR? std::string {v.vec.begin(), v.vec.end()}: v.str;
+}
+inline const nf7_value_t& Field(const nf7_value_t& v, std::string_view name) {
+  for (const auto& [k, x] : v.tup) {
+    if (k == name) return *x;
+  }
+  static const nf7_value_t kNone;
+  return kNone;
+}
+
+// concatenates bytes emitted from the socket
+inline std::string Collect(const std::vector<Emitted>& es, std::string_view name) {
+  std::string ret;
+  for (const auto& e : es) {
+    if (e.name == name) ret += Bytes(e.value);
+  }
+  return ret;
+}
+inline size_t Count(const std::vector<Emitted>& es, std::string_view name) noexcept {
+  size_t ret = 0;
+  for (const auto& e : es) {
+    ret += e.name == name;
+  }
+  return ret;
+}
+
+// true if an error containing the message is emitted
+inline bool HasError(const std::vector<Emitted>& es, std::string_view msg) {
+  for (const auto& e : es) {
+    if (e.name == "error" && e.value.str.find(msg) != std::string::npos) return true;
+  }
+  return false;
+}
+
+// splits data into chunks of n bytes, to be fed one by one
+inline std::vector<std::string> Chunks(std::string_view data, size_t n) {
+  std::vector<std::string> ret;
+  for (size_t i = 0; i < data.size(); i += n) {
+    ret.emplace_back(data.substr(i, n));
+  }
+  return ret;
+}
+
+
+// a file removed at the end of the scope
+struct TempFile final {
+ public:
+  TempFile(std::string_view name, std::string_view data)
+      : path_(std::filesystem::temp_directory_path() / ("passpawn-test-" + std::string {name})) {
+    std::ofstream {path_, std::ios::binary}.write(
+        data.data(), static_cast<std::streamsize>(data.size()));
+  }
+  ~TempFile() noexcept {
+    std::error_code ec;
+    std::filesystem::remove(path_, ec);
+  }
+  TempFile(const TempFile&) = delete;
+  TempFile(TempFile&&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+  TempFile& operator=(TempFile&&) = delete;
+
+  std::string path() const { return path_.string(); }
+
+ private:
+  std::filesystem::path path_;
+};
+
+
+inline int failures_ = 0;
+
+inline void Check(bool ok, const char* expr, const char* file, int line) noexcept {
+  if (!ok) {
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    ++failures_;
+  }
+}
+inline int Result() noexcept {
+  return failures_ > 0? 1: 0;
+}
+
+}  // namespace pp::test
+
+#define PP_TEST_CHECK(expr) ::pp::test::Check((expr), #expr, __FILE__, __LINE__)
+
+const nf7_vtable_t* nf7 = &::pp::test::kVTable;
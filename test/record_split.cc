@@ -0,0 +1,129 @@
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "test/harness.hh"
+
+using namespace pp::test;
+
+extern "C" const nf7_node_t record_split;
+
+
+// feeds chunks after init, and returns emissions
+static std::vector<Emitted> Split(nf7_value_t init, const std::vector<std::string>& chunks,
+                                  bool end = true) {
+  Node n {record_split};
+  n.Send("init", std::move(init));
+  for (const auto& c : chunks) {
+    n.Send("in", Vector(c));
+  }
+  if (end) n.Send("end", Pulse());
+  return n.Run();
+}
+static std::vector<std::string> Outputs(const std::vector<Emitted>& es) {
+  std::vector<std::string> ret;
+  for (const auto& e : es) {
+    if (e.name == "out") ret.push_back(Bytes(e.value));
+  }
+  return ret;
+}
+
+
+static void TestDelimiter() {
+  const std::string data = "a\r\nbb\r\n\r\nccc\rc\r\nlast";
+  const std::vector<std::string> want = {"a", "bb", "", "ccc\rc", "last"};
+  for (size_t n = 1; n <= data.size(); ++n) {
+    const auto es = Split(Tuple({{"delim", String("\r\n")}}), Chunks(data, n));
+    PP_TEST_CHECK(Outputs(es) == want);
+    PP_TEST_CHECK(Count(es, "error") == 0);
+  }
+  PP_TEST_CHECK(Outputs(Split(String(","), {"x,y,"})) == std::vector<std::string>({"x", "y"}));
+}
+
+static void TestDelimiterBatch() {
+  const std::string data = "a\r\nbb\r\n\r\nccc\rc\r\nlast";
+  for (size_t n = 1; n <= data.size(); ++n) {
+    const auto chunks = Chunks(data, n);
+    const auto outs   = Outputs(Split(
+        Tuple({{"delim", String("\r\n")}, {"batch", Integer(1)}}), chunks));
+
+    // batches keep delimiters, and only the record flushed by 'end' lacks it
+    std::string all;
+    for (size_t i = 0; i < outs.size(); ++i) {
+      all += outs[i];
+      PP_TEST_CHECK(i+1 == outs.size() || outs[i].ends_with("\r\n"));
+    }
+    PP_TEST_CHECK(all == data);
+    PP_TEST_CHECK(outs.size() >= 2 && outs.back() == "last");
+    PP_TEST_CHECK(outs.size() <= chunks.size()+1);
+  }
+}
+
+static void TestPrefix() {
+  const std::string big    = std::string {"\x00\x01", 2} + "x" + std::string {"\x00\x00", 2} +
+                             std::string {"\x00\x05", 2} + "hello";
+  const std::string little = std::string {"\x01\x00\x00", 3} + "x" +
+                             std::string {"\x00\x00\x00", 3} +
+                             std::string {"\x05\x00\x00", 3} + "hello";
+  const std::vector<std::string> want = {"x", "", "hello"};
+  for (size_t n = 1; n <= big.size(); ++n) {
+    const auto es = Split(Tuple({{"prefix", Integer(2)}}), Chunks(big, n));
+    PP_TEST_CHECK(Outputs(es) == want);
+    PP_TEST_CHECK(Count(es, "error") == 0);
+  }
+  for (size_t n = 1; n <= little.size(); ++n) {
+    const auto es = Split(Tuple({
+      {"prefix", Integer(3)}, {"endian", String("little")},
+    }), Chunks(little, n));
+    PP_TEST_CHECK(Outputs(es) == want);
+  }
+
+  // batches keep prefixes, and never split a record
+  for (size_t n = 1; n <= big.size(); ++n) {
+    const auto outs = Outputs(Split(Tuple({
+      {"prefix", Integer(2)}, {"batch", Integer(1)},
+    }), Chunks(big, n)));
+    std::string all;
+    for (const auto& o : outs) {
+      for (size_t i = 0; i < o.size();) {
+        PP_TEST_CHECK(i+2 <= o.size());
+        i += 2 + (size_t {static_cast<uint8_t>(o[i])} << 8 | static_cast<uint8_t>(o[i+1]));
+        PP_TEST_CHECK(i <= o.size());
+      }
+      all += o;
+    }
+    PP_TEST_CHECK(all == big);
+  }
+
+  const auto es = Split(Tuple({{"prefix", Integer(2)}}), {std::string {"\x00\x05", 2} + "hel"});
+  PP_TEST_CHECK(Outputs(es).empty());
+  PP_TEST_CHECK(Count(es, "error") == 1);
+}
+
+static void TestMax() {
+  // a stream without delimiters fails instead of growing the partial record
+  auto es = Split(Tuple({{"delim", String("\n")}, {"max", Integer(4)}}),
+                  {"ab", "cd", "ef", "gh\n", "ok\n"});
+  PP_TEST_CHECK(Count(es, "error") == 1);
+  PP_TEST_CHECK(Outputs(es) == std::vector<std::string>({"gh", "ok"}));
+
+  es = Split(Tuple({{"delim", String("\n")}, {"max", Integer(4)}}), {"abcd\n", "abcde\n"});
+  PP_TEST_CHECK(Count(es, "error") == 1);
+  PP_TEST_CHECK(Outputs(es) == std::vector<std::string>({"abcd"}));
+
+  // the broken length is dropped with the error, so the next record is read
+  es = Split(Tuple({{"prefix", Integer(2)}, {"max", Integer(8)}}), {
+    std::string {"\x00", 1}, std::string {"\xFF", 1}, std::string {"\x00\x02", 2} + "hi",
+  });
+  PP_TEST_CHECK(Count(es, "error") == 1);
+  PP_TEST_CHECK(Outputs(es) == std::vector<std::string>({"hi"}));
+}
+
+
+int main() {
+  TestDelimiter();
+  TestDelimiterBatch();
+  TestPrefix();
+  TestMax();
+  return Result();
+}
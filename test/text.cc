@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "test/harness.hh"
+
+using namespace pp::test;
+
+extern "C" const nf7_node_t text_encode;
+extern "C" const nf7_node_t text_decode;
+
+
+// feeds chunks between start and end, and returns emissions
+static std::vector<Emitted> Run(const nf7_node_t& node, std::string_view fmt,
+                                const std::vector<std::string>& chunks) {
+  Node n {node};
+  n.Send("start", String(fmt));
+  for (const auto& c : chunks) {
+    n.Send("in", node.name == std::string_view {"text_encode"}? Vector(c): String(c));
+  }
+  n.Send("end", Pulse());
+  return n.Run();
+}
+static std::string Encode(std::string_view fmt, const std::vector<std::string>& chunks) {
+  return Collect(Run(text_encode, fmt, chunks), "out");
+}
+static std::string Decode(std::string_view fmt, const std::vector<std::string>& chunks) {
+  return Collect(Run(text_decode, fmt, chunks), "out");
+}
+
+// long enough for the vectorized kernels, with every byte value
+static std::string Bytes256(size_t n) {
+  std::string ret(n, '\0');
+  for (size_t i = 0; i < n; ++i) ret[i] = static_cast<char>(i*7 + i/256);
+  return ret;
+}
+
+// straightforward encoders to compare with
+static std::string RefBase64(std::string_view data, bool url) {
+  const char* chars = url?
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_":
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string ret;
+  for (size_t i = 0; i < data.size(); i += 3) {
+    const auto n = std::min<size_t>(3, data.size()-i);
+    uint32_t v = 0;
+    for (size_t j = 0; j < 3; ++j) {
+      v = v << 8 | (j < n? static_cast<uint8_t>(data[i+j]): 0u);
+    }
+    for (size_t j = 0; j < 4; ++j) {
+      if (j <= n) {
+        ret += chars[(v >> (18-j*6)) & 0x3F];
+      } else if (!url) {
+        ret += '=';
+      }
+    }
+  }
+  return ret;
+}
+static std::string RefHex(std::string_view data) {
+  std::string ret;
+  for (auto c : data) {
+    ret += "0123456789abcdef"[static_cast<uint8_t>(c) >> 4];
+    ret += "0123456789abcdef"[static_cast<uint8_t>(c) & 0xF];
+  }
+  return ret;
+}
+
+
+// RFC 4648 section 10
+static void TestVectors() {
+  const std::vector<std::pair<std::string, std::string>> base64 = {
+    {"", ""}, {"f", "Zg=="}, {"fo", "Zm8="}, {"foo", "Zm9v"},
+    {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="}, {"foobar", "Zm9vYmFy"},
+  };
+  for (const auto& [data, text] : base64) {
+    PP_TEST_CHECK(Encode("base64", {data}) == text);
+    PP_TEST_CHECK(Decode("base64", {text}) == data);
+  }
+
+  const std::vector<std::pair<std::string, std::string>> hex = {
+    {"", ""}, {"f", "66"}, {"fo", "666f"}, {"foobar", "666f6f626172"},
+  };
+  for (const auto& [data, text] : hex) {
+    PP_TEST_CHECK(Encode("hex", {data}) == text);
+    PP_TEST_CHECK(Decode("hex", {text}) == data);
+  }
+  PP_TEST_CHECK(Decode("hex", {"666F6F"}) == "foo");
+
+  // base64url is not padded, and either alphabet is decoded
+  PP_TEST_CHECK(Encode("base64url", {"\xfb\xff\xbf"}) == "-_-_");
+  PP_TEST_CHECK(Encode("base64url", {"\xfb\xff"}) == "-_8");
+  PP_TEST_CHECK(Encode("base64", {"\xfb\xff"}) == "+/8=");
+  PP_TEST_CHECK(Decode("base64url", {"-_8"}) == "\xfb\xff");
+  PP_TEST_CHECK(Decode("base64", {"-_8="}) == "\xfb\xff");
+  PP_TEST_CHECK(Decode("base64url", {"+/8"}) == "\xfb\xff");
+}
+
+static void TestChunks() {
+  const auto data = Bytes256(1000);
+  const auto b64  = RefBase64(data, false);
+  const auto url  = RefBase64(data, true);
+  const auto hex  = RefHex(data);
+  for (const size_t n : {1u, 2u, 3u, 5u, 31u, 32u, 33u, 100u, 1000u}) {
+    PP_TEST_CHECK(Encode("base64",    Chunks(data, n)) == b64);
+    PP_TEST_CHECK(Encode("base64url", Chunks(data, n)) == url);
+    PP_TEST_CHECK(Encode("hex",       Chunks(data, n)) == hex);
+  }
+  for (const size_t n : {1u, 3u, 4u, 7u, 32u, 33u, 100u, 2000u}) {
+    PP_TEST_CHECK(Decode("base64",    Chunks(b64, n)) == data);
+    PP_TEST_CHECK(Decode("base64url", Chunks(url, n)) == data);
+    PP_TEST_CHECK(Decode("hex",       Chunks(hex, n)) == data);
+  }
+
+  // padded groups may be concatenated
+  PP_TEST_CHECK(Decode("base64", {"Zg==Zm8=", "Zm9v"}) == "ffofoo");
+}
+
+static void TestWhitespace() {
+  const auto data = Bytes256(300);
+
+  std::string b64, hex;
+  const auto wrap = [](std::string_view text, std::string& dst) {
+    for (size_t i = 0; i < text.size(); i += 76) {
+      dst += text.substr(i, 76);
+      dst += "\r\n";
+    }
+  };
+  wrap(RefBase64(data, false), b64);
+  wrap(RefHex(data), hex);
+  PP_TEST_CHECK(Decode("base64", {b64}) == data);
+  PP_TEST_CHECK(Decode("base64", Chunks(b64, 7)) == data);
+  PP_TEST_CHECK(Decode("hex", {hex}) == data);
+  PP_TEST_CHECK(Decode("hex", Chunks(hex, 7)) == data);
+  PP_TEST_CHECK(Decode("base64", {" Zm9v\tYm", "Fy \n"}) == "foobar");
+  PP_TEST_CHECK(Decode("hex", {"66 6f\n6f"}) == "foo");
+}
+
+static void TestInvalid() {
+  PP_TEST_CHECK(HasError(Run(text_decode, "base64", {"Zm9v!"}), "invalid base64 char"));
+  PP_TEST_CHECK(HasError(Run(text_decode, "base64", {"Zg=x"}), "base64 data after padding"));
+  PP_TEST_CHECK(HasError(Run(text_decode, "base64", {"Z==="}), "misplaced base64 padding"));
+  PP_TEST_CHECK(HasError(Run(text_decode, "base64", {"Zm9vY"}), "truncated base64"));
+  PP_TEST_CHECK(HasError(Run(text_decode, "hex", {"66", "6"}), "odd number of hex digits"));
+  PP_TEST_CHECK(HasError(Run(text_decode, "hex", {"6g"}), "invalid hex digit"));
+
+  // a broken char in the middle of a block for the vectorized kernels
+  auto b64 = RefBase64(Bytes256(300), false);
+  b64[100] = '*';
+  PP_TEST_CHECK(HasError(Run(text_decode, "base64", {b64}), "invalid base64 char"));
+
+  // the partial group is dropped with the error, so the next stream is clean
+  Node n {text_decode};
+  n.Send("start", String("base64"));
+  n.Send("in", String("Zm9!"));
+  n.Send("in", String("Zm9v"));
+  n.Send("end", Pulse());
+  const auto es = n.Run();
+  PP_TEST_CHECK(Count(es, "error") == 1);
+  PP_TEST_CHECK(Collect(es, "out") == "foo");
+
+  Node e {text_encode};
+  e.Send("start", String("base32"));
+  PP_TEST_CHECK(HasError(e.Run(), "unknown format"));
+}
+
+
+int main() {
+  TestVectors();
+  TestChunks();
+  TestWhitespace();
+  TestInvalid();
+  return Result();
+}
@@ -1,2 +1,13 @@
+#include <stddef.h>
+
+// allocation hooks implemented by passpawn-codec (codec/stb_image.cc)
+void* pp_stbi_malloc(size_t);
+void* pp_stbi_realloc(void*, size_t);
+void  pp_stbi_free(void*);
+
+#define STBI_MALLOC(sz)     pp_stbi_malloc(sz)
+#define STBI_REALLOC(p, sz) pp_stbi_realloc(p, sz)
+#define STBI_FREE(p)        pp_stbi_free(p)
+
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>